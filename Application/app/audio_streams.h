@@ -0,0 +1,29 @@
+#ifndef __AUDIO_STREAMS_H__
+#define __AUDIO_STREAMS_H__
+
+/* Geometry of the audio streams, shared by the application and by audio buffer fast paths
+ * (the build passes this header as UM_STREAMS_CONFIG, see audio_buffer.h) */
+
+#include "tusb_config.h"
+
+#define UM_OUT_PACKET_SIZE          192
+#define UM_OUT_SAMPLE_SIZE          (CFG_TUD_AUDIO_FUNC_1_N_CHANNELS_RX * CFG_TUD_AUDIO_FUNC_1_FORMAT_1_N_BYTES_PER_SAMPLE_RX)
+#define UM_OUT_FRAMES_IN_NODE       1
+/* UM_BUFFER_CONFIG_CA_FEEDBACK relies on host, which follows feedback endpoint;
+ * UM_BUFFER_CONFIG_CA_ASRC resamples stream to codec clock on device side */
+#define UM_OUT_CA_MODE              UM_BUFFER_CONFIG_CA_FEEDBACK
+
+#define UM_IN_PACKET_SIZE           384
+#define UM_IN_SAMPLE_SIZE           (CFG_TUD_AUDIO_FUNC_1_N_CHANNELS_TX * CFG_TUD_AUDIO_FUNC_1_FORMAT_1_N_BYTES_PER_SAMPLE_TX)
+#define UM_IN_FRAMES_IN_NODE        1
+/* UM_BUFFER_CONFIG_CA_FEEDBACK sends 47/48/49 frame packets by capture fill level (asynchronous IN endpoint),
+ * so capture clock may drift; UM_BUFFER_CONFIG_CA_NONE sends fixed packets, capture has to run at host rate
+ * (analog microphone: ADC trigger is locked to SOF) */
+#define UM_IN_CA_MODE               UM_BUFFER_CONFIG_CA_FEEDBACK
+
+/* um_handle_commit_out, um_handle_read_in */
+#define UM_STREAMS(OUT, IN) \
+    OUT(out, UM_OUT_CA_MODE, UM_OUT_PACKET_SIZE, UM_OUT_SAMPLE_SIZE, UM_OUT_FRAMES_IN_NODE) \
+    IN(in, UM_IN_CA_MODE, UM_IN_PACKET_SIZE, UM_IN_SAMPLE_SIZE, UM_IN_FRAMES_IN_NODE)
+
+#endif
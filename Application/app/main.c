@@ -10,6 +10,8 @@
 #include "stm32_audio_feedback_driver.h"
 
 #include "audio_buffer.h"
+#include "audio_feedback.h"
+#include "audio_streams.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -39,15 +41,110 @@ const uint32_t sample_rates[] = { 48000 };
 
 uint32_t current_sample_rate  = 48000;
 
-struct um_buffer_handle *um_out_buffer, *um_in_buffer;
+/* packet/sample size, frames in node and CA mode of both streams are in audio_streams.h */
+#define UM_OUT_NODES                16
+#define UM_OUT_LATENCY_US           2000
+/* 1: USB peripheral writes OUT packets directly into the ring (EP OUT FIFO of TinyUSB is moved onto it);
+ * 0: packets are read from TinyUSB FIFO into the ring. Zero-copy needs CA_FEEDBACK or CA_STRETCH */
+#define UM_OUT_ZERO_COPY            1
+
+#if UM_OUT_ZERO_COPY && UM_OUT_CA_MODE != UM_BUFFER_CONFIG_CA_FEEDBACK && UM_OUT_CA_MODE != UM_BUFFER_CONFIG_CA_STRETCH
+#error "UM_OUT_ZERO_COPY is supported only with byte counted modes, which keep packet in place"
+#endif
+
+#define UM_IN_NODES                 16
+#define UM_IN_LATENCY_US            2000
+/* 1: IN transfer is loaded straight from the capture ring (EP IN FIFO of TinyUSB is moved onto it);
+ * 0: packets are written from the ring into TinyUSB FIFO */
+#define UM_IN_ZERO_COPY             1
+/* Capture dropped after the mic is started, while its output settles; zeros are sent meanwhile */
+#define UM_IN_SETTLE_US             50000
+
+/* 1: I2S/ADC DMA keeps running, while streaming interface is in alt 0 (silence is played, capture is dropped),
+ * so the first packet of the next stream is handled within a frame; 0: hardware is stopped */
+#define UM_WARM_STANDBY             1
+
+/* Target latency of the stream in microseconds: SET_CUR/GET_CUR class request to its streaming interface (entity 0)
+ * with 4 byte parameter block; selector follows the AS interface controls of UAC2 */
+#define AS_CTRL_TARGET_LATENCY      0x80
+
+static uint8_t um_out_mem[UM_BUFFER_MEM_SIZE(UM_OUT_PACKET_SIZE, UM_OUT_FRAMES_IN_NODE, UM_OUT_NODES)] __attribute__ ((aligned(4)));
+static uint8_t um_in_mem[UM_BUFFER_MEM_SIZE(UM_IN_PACKET_SIZE, UM_IN_FRAMES_IN_NODE, UM_IN_NODES)] __attribute__ ((aligned(4)));
+
+static struct um_buffer_handle um_out_handle, um_in_handle;
+struct um_buffer_handle *um_out_buffer = &um_out_handle, *um_in_buffer = &um_in_handle;
 
 #define N_SAMPLE_RATES  TU_ARRAY_SIZE(sample_rates)
 
-#define FBCK_TASK_QUEUE_SIZE    2
-OSAL_QUEUE_DEF(FBCK_int_set, __fbck_qdef, FBCK_TASK_QUEUE_SIZE, uint32_t);
-static osal_queue_t __fbck_q;
+/* Alternate settings of streaming interfaces */
+static uint8_t out_alt, in_alt;
+/* Target latency set by host while streaming, 0: none; ring is resized between transfers, not under an armed one */
+static uint32_t out_latency_req, in_latency_req;
+/* OUT packets dropped for lack of room in the ring */
+static volatile uint32_t out_dropped_packets;
+
+/* Newest feedback value, posted by feedback driver and sent at SOF */
+static struct um_fb_mailbox fbck_mailbox;
+
+#if UM_OUT_ZERO_COPY
+/* TinyUSB own EP OUT buffer; packets, which do not fit in the ring, are received there and dropped */
+static uint8_t *out_drop_buf = NULL;
 
-void feedback_sender_task(void);
+/* Points EP OUT FIFO to the place, where the next packet should be received to. Called, while no transfer is armed:
+ * on mount, in alt 0 (TinyUSB arms the first transfer on the FIFO, when alt 1 is set) and from rx done callback */
+static void audio_out_arm_rx(void)
+{
+  tu_fifo_t *ff = tud_audio_get_ep_out_ff();
+  uint32_t offset = 0;
+
+  if(out_drop_buf == NULL)
+    out_drop_buf = ff->buffer;
+
+  /* the largest packet of alt 1: host sends one frame more than nominal, when it follows feedback */
+  if(um_handle_get_rx_window(um_out_buffer, &offset) >= um_out_buffer->um_usb_packet_size + um_out_buffer->um_sample_size)
+  {
+    /* empty FIFO over the whole ring, positioned at USB write offset; wraps as the ring does */
+    tu_fifo_config(ff, um_out_buffer->um_buffer, um_out_buffer->total_buffer_size, 1, false);
+    tu_fifo_advance_write_pointer(ff, offset);
+    tu_fifo_advance_read_pointer(ff, offset);
+  }
+  else
+  {
+    tu_fifo_config(ff, out_drop_buf, CFG_TUD_AUDIO_FUNC_1_EP_OUT_SW_BUF_SZ, 1, false);
+  }
+}
+#endif
+
+#if UM_IN_ZERO_COPY
+/* TinyUSB own EP IN buffer; silence is sent from it, when capture ring has no data or capture is settling */
+static uint8_t *in_silence_buf = NULL;
+
+/* Points EP IN FIFO to the packet, which should be sent next. Called before transfer is armed */
+static void audio_in_load_tx(uint8_t *pkt, uint32_t size)
+{
+  tu_fifo_t *ff = tud_audio_get_ep_in_ff();
+
+  if(in_silence_buf == NULL)
+    in_silence_buf = ff->buffer;
+
+  if(pkt >= um_in_buffer->um_buffer && pkt < um_in_buffer->um_buffer + um_in_buffer->total_buffer_size)
+  {
+    uint32_t offset = (uint32_t)(pkt - um_in_buffer->um_buffer);
+
+    /* FIFO over the whole ring, holding just the packet; packet, which crosses the end of the ring, wraps as FIFO does */
+    tu_fifo_config(ff, um_in_buffer->um_buffer, um_in_buffer->total_buffer_size, 1, false);
+    tu_fifo_advance_write_pointer(ff, offset + size);
+    tu_fifo_advance_read_pointer(ff, offset);
+  }
+  else
+  {
+    /* NULL on underrun; during preroll the handle gives its silent node, which is outside of the ring */
+    memset(in_silence_buf, 0, size);
+    tu_fifo_config(ff, in_silence_buf, CFG_TUD_AUDIO_FUNC_1_EP_IN_SW_BUF_SZ, 1, false);
+    tu_fifo_advance_write_pointer(ff, size);
+  }
+}
+#endif
 
 static void cs43l22_play(uint32_t addr, uint32_t size)
 {
@@ -62,6 +159,11 @@ static uint32_t cs43l22_pause_resume(uint32_t cmd, uint32_t addr, uint32_t size)
   return EVAL_AUDIO_PauseResume(cmd);
 }
 
+static void cs43l22_next_node(uint32_t addr)
+{
+  EVAL_AUDIO_SetNextBuffer((uint16_t *)addr);
+}
+
 static void max9814_play(uint32_t addr, uint32_t size)
 {
   Analog_MIC_Start((uint16_t *)addr, size, DMA_DOUBLE_BUFFER_MODE_ENABLE);
@@ -83,6 +185,11 @@ static uint32_t max9814_pause_resume(uint32_t cmd, uint32_t addr, uint32_t size)
   return 0;
 }
 
+static void max9814_next_node(uint32_t addr)
+{
+  Analog_MIC_SetNextBuffer((uint16_t *)addr);
+}
+
 static void msm261s_play(uint32_t addr, uint32_t size)
 {
   MEMS_MIC_Start((uint16_t *)addr, size, DMA_DOUBLE_BUFFER_MODE_ENABLE);
@@ -98,53 +205,103 @@ static uint32_t msm261s_pause_resume(uint32_t cmd, uint32_t addr, uint32_t size)
   return 0;
 }
 
-void audio_buffer_out_free_space_handle(void *free_space_persentage)
+static void msm261s_next_node(uint32_t addr)
 {
-  uint32_t free_space = *(uint32_t *)free_space_persentage;
-  FBCK_adjust_bitrate(free_space);
+  MEMS_MIC_SetNextBuffer((uint16_t *)addr);
 }
 
-void audio_buffer_in_free_space_handle(void *free_space_persentage)
+/* Fixed IN packets: fractional ADC rate follows capture fill error, once the stream is playing */
+static void audio_in_update_rate(void)
 {
-  uint32_t free_space = *(uint32_t *)free_space_persentage;
-  Analog_MIC_adjust_bitrate(free_space);
+#if UM_IN_CA_MODE == UM_BUFFER_CONFIG_CA_NONE && ADC_RATE_CONTROL == ADC_RATE_FRACTIONAL
+  if(um_in_buffer->um_buffer_state == UM_BUFFER_STATE_PLAY && !um_in_buffer->um_standby)
+    Analog_MIC_update_fill((int32_t)um_handle_get_fill_samples(um_in_buffer) - (int32_t)(um_in_buffer->um_target_fill / UM_IN_SAMPLE_SIZE));
+#endif
+}
+
+/* Feedback is corrected by OUT fill error, once the stream is playing; pending: samples not in the ring yet */
+static void audio_out_update_feedback(uint32_t pending)
+{
+#if UM_OUT_CA_MODE == UM_BUFFER_CONFIG_CA_FEEDBACK
+  if(um_out_buffer->um_buffer_state == UM_BUFFER_STATE_PLAY && !um_out_buffer->um_standby)
+    FBCK_update_fill((int32_t)(um_handle_get_fill_samples(um_out_buffer) + pending) - (int32_t)(um_out_buffer->um_target_fill / UM_OUT_SAMPLE_SIZE));
+#else
+  (void)pending;
+#endif
+}
+
+/* Sets target latency, which host has asked for; called between transfers of the stream or in alt 0 */
+static bool audio_apply_latency(struct um_buffer_handle *handle, uint32_t *latency_req)
+{
+  uint32_t latency_us = *latency_req;
+
+  if(latency_us == 0)
+    return true;
+
+  *latency_req = 0;
+  /* ring is kept as it is, if the latency does not fit into it */
+  TU_VERIFY(um_handle_set_target_latency(handle, latency_us) == UM_EOK);
+
+  TU_LOG1("Latency %lu us\r\n", latency_us);
+  return true;
 }
 
+#ifdef UM_BENCH
+void um_bench_run(void);
+#endif
+
 int main(void)
 {
   int result = 0;
   board_init();
 
+#ifdef UM_BENCH
+  /* tools/bench: cycle cost of audio buffer hot paths, before any audio hardware is started */
+  um_bench_run();
+#endif
+
   EVAL_AUDIO_Init(OUTPUT_DEVICE_AUTO, 100, 48000);
   MEMS_MIC_Init();
   Analog_MIC_Init();
-  FBCK_Init(0x18000);
+  /* 48 samples per frame, 16.16 */
+  FBCK_Init(48 << 16);
 
-  __fbck_q = osal_queue_create(&__fbck_qdef);
-  if(__fbck_q == NULL) while(1) {}
+  result = um_handle_init(um_out_buffer, um_out_mem, sizeof(um_out_mem),
+    UM_OUT_PACKET_SIZE, UM_OUT_SAMPLE_SIZE, UM_OUT_FRAMES_IN_NODE, UM_OUT_NODES, UM_OUT_CA_MODE,
+    cs43l22_play, cs43l22_pause_resume, cs43l22_next_node);
+  result += um_handle_init(um_in_buffer, um_in_mem, sizeof(um_in_mem),
+    UM_IN_PACKET_SIZE, UM_IN_SAMPLE_SIZE, UM_IN_FRAMES_IN_NODE, UM_IN_NODES, UM_IN_CA_MODE | UM_BUFFER_CONFIG_DIR_IN,
+//    max9814_play, max9814_pause_resume, max9814_next_node);
+      msm261s_play, msm261s_pause_resume, msm261s_next_node);
 
-  um_out_buffer = (struct um_buffer_handle *) malloc(sizeof(struct um_buffer_handle));
-  um_in_buffer = (struct um_buffer_handle *) malloc(sizeof(struct um_buffer_handle));
-
-  result = um_handle_init(um_out_buffer, 192, 4, 4, UM_BUFFER_CONFIG_CA_FEEDBACK,
-    cs43l22_play, cs43l22_pause_resume);
-  result += um_handle_init(um_in_buffer, 384, 4, 4, UM_BUFFER_CONFIG_CA_NONE,
-//    max9814_play, max9814_pause_resume);
-      msm261s_play, msm261s_pause_resume);
+  result += um_handle_set_target_latency(um_out_buffer, UM_OUT_LATENCY_US);
+  result += um_handle_set_target_latency(um_in_buffer, UM_IN_LATENCY_US);
+  result += um_handle_set_settle_time(um_in_buffer, UM_IN_SETTLE_US);
 
   if(result != UM_EOK)
   {
     while(1) {}
   }
 
-  um_handle_register_listener(um_out_buffer, UM_LISTENER_TYPE_CA, audio_buffer_out_free_space_handle);
-  um_handle_register_listener(um_in_buffer, UM_LISTENER_TYPE_CA, audio_buffer_in_free_space_handle);
+  um_handle_set_hw_position(um_out_buffer, EVAL_AUDIO_GetPosition);
+
+#if UM_OUT_ZERO_COPY || UM_IN_ZERO_COPY
+  /* EP FIFO depth is 16 bit */
+  if(um_out_buffer->total_buffer_size > UINT16_MAX || um_in_buffer->total_buffer_size > UINT16_MAX)
+  {
+    while(1) {}
+  }
+#endif
+//  um_handle_set_hw_position(um_in_buffer, Analog_MIC_GetPosition);
+  um_handle_set_hw_position(um_in_buffer, MEMS_MIC_GetPosition);
 
   tusb_init();
+#if FBCK_SOURCE == FBCK_SOURCE_FILL
+  tud_sof_cb_enable(true);
+#endif
 
   while(true)
   {
-    feedback_sender_task();
     tud_task();
   }
 
@@ -331,6 +488,16 @@ static bool tud_audio_selector_unit_set_request(uint8_t rhport, audio_control_re
 // Application Callback API Implementations
 //--------------------------------------------------------------------+
 
+// Invoked when device is configured; streaming interfaces are in alt 0, bus reset has cleared EP OUT FIFO
+void tud_mount_cb(void)
+{
+  out_alt = 0;
+  in_alt = 0;
+#if UM_OUT_ZERO_COPY
+  audio_out_arm_rx();
+#endif
+}
+
 // Invoked when audio class specific get request received for an entity
 bool tud_audio_get_req_entity_cb(uint8_t rhport, tusb_control_request_t const *p_request)
 {
@@ -388,19 +555,41 @@ bool tud_audio_set_itf_cb(uint8_t rhport, tusb_control_request_t const * p_reque
 
   if(itf == 2)
   {
+    in_alt = alt;
+
     if(alt == 0)
     {
+#if UM_WARM_STANDBY
+      um_handle_standby(um_in_buffer);
+#else
       um_handle_pause(um_in_buffer);
+#endif
+      audio_apply_latency(um_in_buffer, &in_latency_req);
     }
     else if(alt == 1)
     {
-      um_handle_dequeue(um_in_buffer, um_in_buffer->um_usb_packet_size);
+      /* starts hardware; silence is sent until capture fills target latency */
+      um_handle_start(um_in_buffer);
     }
   }
   else if (itf == 1)
   {
+    out_alt = alt;
+
     if(alt == 0)
     {
+#if UM_WARM_STANDBY
+      um_handle_standby(um_out_buffer);
+#else
+      /* underruns do not stop codec; stream is over, so the next one starts with target latency again */
+      if(um_out_buffer->um_buffer_state == UM_BUFFER_STATE_PLAY)
+        um_handle_pause(um_out_buffer);
+#endif
+      audio_apply_latency(um_out_buffer, &out_latency_req);
+#if UM_OUT_ZERO_COPY
+      /* endpoint is closed; the first transfer of alt 1 is armed by TinyUSB before this callback is invoked for it */
+      audio_out_arm_rx();
+#endif
       FBCK_Stop();
     }
     else if(alt == 1)
@@ -413,20 +602,126 @@ bool tud_audio_set_itf_cb(uint8_t rhport, tusb_control_request_t const * p_reque
   return true;
 }
 
+// Invoked when audio class specific set request received for an interface
+bool tud_audio_set_req_itf_cb(uint8_t rhport, tusb_control_request_t const *p_request, uint8_t *buf)
+{
+  audio_control_request_t const *request = (audio_control_request_t const *)p_request;
+  uint32_t latency_us;
+  (void)rhport;
+
+  TU_VERIFY(request->bControlSelector == AS_CTRL_TARGET_LATENCY && request->bRequest == AUDIO_CS_REQ_CUR);
+  TU_VERIFY(request->wLength == sizeof(audio_control_cur_4_t));
+
+  latency_us = (uint32_t)tu_le32toh(((audio_control_cur_4_t const *)buf)->bCur);
+  TU_VERIFY(latency_us != 0);
+
+  TU_LOG1("Set interface %d latency %lu us\r\n", request->bInterface, latency_us);
+
+  /* while streaming, latency is set from transfer callback, after the packet in flight is done */
+  if(request->bInterface == ITF_NUM_AUDIO_STREAMING_SPK)
+  {
+    out_latency_req = latency_us;
+    if(out_alt != 0)
+      return true;
+
+    TU_VERIFY(audio_apply_latency(um_out_buffer, &out_latency_req));
+#if UM_OUT_ZERO_COPY
+    /* ring is resized and USB position is reset */
+    audio_out_arm_rx();
+#endif
+    return true;
+  }
+  else if(request->bInterface == ITF_NUM_AUDIO_STREAMING_MIC)
+  {
+    in_latency_req = latency_us;
+    return in_alt != 0 || audio_apply_latency(um_in_buffer, &in_latency_req);
+  }
+
+  return false;
+}
+
+// Invoked when audio class specific get request received for an interface
+bool tud_audio_get_req_itf_cb(uint8_t rhport, tusb_control_request_t const *p_request)
+{
+  audio_control_request_t const *request = (audio_control_request_t const *)p_request;
+  struct um_buffer_handle *handle;
+
+  TU_VERIFY(request->bControlSelector == AS_CTRL_TARGET_LATENCY && request->bRequest == AUDIO_CS_REQ_CUR);
+
+  if(request->bInterface == ITF_NUM_AUDIO_STREAMING_SPK)
+    handle = um_out_buffer;
+  else if(request->bInterface == ITF_NUM_AUDIO_STREAMING_MIC)
+    handle = um_in_buffer;
+  else
+    return false;
+
+  /* latency in use; the one set while streaming is reported, once it has been applied */
+  audio_control_cur_4_t cur = { (int32_t) tu_htole32(um_handle_get_target_latency(handle)) };
+  return tud_audio_buffer_and_schedule_control_xfer(rhport, p_request, &cur, sizeof(cur));
+}
+
+#if UM_OUT_ZERO_COPY
 bool tud_audio_rx_done_pre_read_cb(uint8_t rhport, uint16_t n_bytes_received, uint8_t func_id, uint8_t ep_out, uint8_t cur_alt_setting)
 {
-  uint16_t real_pkt_size = 0;
   (void)rhport;
   (void)func_id;
   (void)ep_out;
   (void)cur_alt_setting;
 
-  real_pkt_size = tud_audio_read(um_out_buffer->cur_um_node_for_usb->um_buf + um_out_buffer->cur_um_node_for_usb->um_node_offset, n_bytes_received);
+  /* packet is already in the ring, unless there was no room for it; if engine drops it anyway,
+   * it stays unaccounted and the next one is received over it */
+  if(tud_audio_get_ep_out_ff()->buffer != um_out_buffer->um_buffer ||
+     um_handle_commit_out(um_out_buffer, n_bytes_received) != UM_EOK)
+  {
+    out_dropped_packets++;
+  }
+#if FBCK_SOURCE == FBCK_SOURCE_MCLK
+  audio_out_update_feedback(0);
+#endif
 
-  um_handle_enqueue(um_out_buffer, real_pkt_size);
+  /* TinyUSB arms the next transfer right after this callback */
+  audio_apply_latency(um_out_buffer, &out_latency_req);
+  audio_out_arm_rx();
 
   return true;
 }
+#else
+bool tud_audio_rx_done_pre_read_cb(uint8_t rhport, uint16_t n_bytes_received, uint8_t func_id, uint8_t ep_out, uint8_t cur_alt_setting)
+{
+  struct um_span span[2];
+  uint32_t span_count = 0;
+  uint32_t real_pkt_size = 0;
+  (void)rhport;
+  (void)func_id;
+  (void)ep_out;
+  (void)cur_alt_setting;
+
+  /* packet is read directly into the ring; it is dropped, if there is no room for it */
+  span_count = um_handle_reserve(um_out_buffer, n_bytes_received, span);
+  if(span_count == 0)
+  {
+    out_dropped_packets++;
+    tud_audio_clear_ep_out_ff();
+    audio_apply_latency(um_out_buffer, &out_latency_req);
+    return true;
+  }
+
+  for(uint32_t i = 0; i < span_count; i++)
+  {
+    real_pkt_size += tud_audio_read(span[i].ptr, span[i].size);
+  }
+
+  if(um_handle_commit_out(um_out_buffer, real_pkt_size) != UM_EOK)
+    out_dropped_packets++;
+#if FBCK_SOURCE == FBCK_SOURCE_MCLK
+  audio_out_update_feedback(0);
+#endif
+
+  audio_apply_latency(um_out_buffer, &out_latency_req);
+
+  return true;
+}
+#endif
 
 bool tud_audio_tx_done_pre_load_cb(uint8_t rhport, uint8_t itf, uint8_t ep_in, uint8_t cur_alt_setting)
 {
@@ -435,7 +730,27 @@ bool tud_audio_tx_done_pre_load_cb(uint8_t rhport, uint8_t itf, uint8_t ep_in, u
   (void)cur_alt_setting;
   (void)ep_in;
 
-  tud_audio_write(um_handle_dequeue(um_in_buffer, um_in_buffer->um_usb_packet_size), um_in_buffer->um_usb_packet_size);
+  struct um_span span[2];
+  uint32_t span_count;
+
+  /* previous packet is sent, the next one is loaded below */
+  audio_apply_latency(um_in_buffer, &in_latency_req);
+  span_count = um_handle_read_in(um_in_buffer, span);
+
+  audio_in_update_rate();
+
+#if UM_IN_ZERO_COPY
+  /* TinyUSB sends whatever is in EP IN FIFO right after this callback; the second span follows the first one in the FIFO */
+  if(span_count != 0)
+    audio_in_load_tx(span[0].ptr, span[0].size + (span_count > 1 ? span[1].size : 0));
+  else
+    audio_in_load_tx(NULL, um_in_buffer->um_usb_packet_size);
+#else
+  for(uint32_t i = 0; i < span_count; i++)
+  {
+    tud_audio_write(span[i].ptr, span[i].size);
+  }
+#endif
 
   return true;
 }
@@ -443,34 +758,38 @@ bool tud_audio_tx_done_pre_load_cb(uint8_t rhport, uint8_t itf, uint8_t ep_in, u
 void tud_audio_feedback_params_cb(uint8_t func_id, uint8_t alt_itf, audio_feedback_params_t* feedback_param)
 {
   (void)func_id;
+  (void)alt_itf;
 
-  feedback_param->method = AUDIO_FEEDBACK_METHOD_FREQUENCY_FIXED;
-  feedback_param->frequency.mclk_freq = 256 * 48000;
+  /* value is computed by feedback driver (MCLK window and fill correction) and set as it is */
+  feedback_param->method = AUDIO_FEEDBACK_METHOD_DISABLED;
   feedback_param->sample_freq = 48000;
 }
 
 
-void feedback_sender_task(void)
+#if FBCK_SOURCE == FBCK_SOURCE_FILL
+// Invoked at every SOF: fill level is sampled before the packet of this frame is received
+void tud_sof_cb(uint32_t frame_count)
 {
-  while(1)
-  {
-    uint32_t new_feedback;
-    if( !osal_queue_receive(__fbck_q, &new_feedback, UINT32_MAX) ) return;
+  (void)frame_count;
 
-    tud_audio_feedback_update(0, new_feedback);
-  }
+  audio_out_update_feedback(UM_OUT_PACKET_SIZE / UM_OUT_SAMPLE_SIZE);
 }
+#endif
 
-void FBCK_send_feedback(uint32_t feedback)
+// Invoked in SOF interrupt at the start of every feedback interval: the newest value goes to the host
+void tud_audio_feedback_interval_isr(uint8_t func_id, uint32_t frame_number, uint8_t interval_shift)
 {
-  uint32_t f = feedback;
+  uint32_t feedback;
+  (void)frame_number;
+  (void)interval_shift;
 
-  osal_queue_send(__fbck_q, &f, true);
+  if(um_fb_take(&fbck_mailbox, &feedback))
+    tud_audio_n_fb_set(func_id, feedback);
 }
 
-void EVAL_AUDIO_HalfCpltCallback(void)
+void FBCK_send_feedback(uint32_t feedback)
 {
-  audio_dma_complete_cb(um_out_buffer);
+  um_fb_post(&fbck_mailbox, feedback);
 }
 
 void EVAL_AUDIO_CpltCallback(void)
@@ -478,11 +797,6 @@ void EVAL_AUDIO_CpltCallback(void)
   audio_dma_complete_cb(um_out_buffer);
 }
 
-void MEMS_MIC_HalfCpltCallback(void)
-{
-  audio_dma_complete_cb(um_in_buffer);
-}
-
 void MEMS_MIC_CpltCallback(void)
 {
   audio_dma_complete_cb(um_in_buffer);
@@ -492,8 +806,3 @@ void Analog_MIC_ConvCpltCallback(void)
 {
   audio_dma_complete_cb(um_in_buffer);
 }
-
-void Analog_MIC_ConvHalfCpltCallback(void)
-{
-  audio_dma_complete_cb(um_in_buffer);
-}
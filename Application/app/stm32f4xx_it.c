@@ -1,9 +1,16 @@
 #include "stm32f4xx_hal.h"
+#include "stm32_audio_feedback_driver.h"
+#include "stm32_adc_driver.h"
 
 extern DMA_HandleTypeDef hdma_spi2_rx;
 extern DMA_HandleTypeDef hdma_spi3_tx;
 extern DMA_HandleTypeDef hdma_adc1;
+#if FBCK_SOURCE == FBCK_SOURCE_MCLK
 extern DMA_HandleTypeDef hdma_tim2_ch1;
+#endif
+#if ADC_RATE_CONTROL == ADC_RATE_FRACTIONAL
+extern DMA_HandleTypeDef hdma_tim1_up;
+#endif
 
 
 /**
@@ -30,10 +37,22 @@ void DMA2_Stream0_IRQHandler(void)
   HAL_DMA_IRQHandler(&hdma_adc1);
 }
 
+#if FBCK_SOURCE == FBCK_SOURCE_MCLK
 /**
   * @brief This function handles DMA1 stream5 global interrupt.
   */
 void DMA1_Stream5_IRQHandler(void)
 {
   HAL_DMA_IRQHandler(&hdma_tim2_ch1);
-}
\ No newline at end of file
+}
+#endif
+
+#if ADC_RATE_CONTROL == ADC_RATE_FRACTIONAL
+/**
+  * @brief This function handles DMA2 stream5 global interrupt.
+  */
+void DMA2_Stream5_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_tim1_up);
+}
+#endif
\ No newline at end of file
@@ -2,33 +2,33 @@
 #include "stm32f4xx_hal_msp.h"
 
 #include "stm32_adc_driver.h"
+#include "audio_feedback.h"
+
+#define ARR_SIZE(arr)             (sizeof(arr) / sizeof(arr[0]))
+
+/* TIM1 runs from 168 MHz: 3500 clocks per sample is 48 kHz, 48 samples per 1 ms frame */
+#define ADC_TIM_CLOCKS_IN_FRAME   168000
+#define ADC_SAMPLES_IN_FRAME      48
+#define ADC_TIM_PERIOD            (3500 - 1)
+#define ADC_TIM_PULSE             (3500 / 2)
 
 ADC_HandleTypeDef hadc1;
 DMA_HandleTypeDef hdma_adc1;
 TIM_HandleTypeDef htim1;
 
-#define COUNT_SIZE    5
-static uint8_t counter25_idx;
-static uint8_t counter50_idx;
-static uint8_t counter75_idx;
-
-enum __target_freq {
-  freq_47000 = 0,
-  freq_48000,
-  freq_49000
-};
-
-enum __target_quantity {
-  period = 0,
-  pulse
-};
-
-static uint32_t period_pulse_table[3][2] =
-{ /* Period       Pulse */
-  {   3574,       1787  }, /* 47000 kHz */
-  {   3500,       1750  }, /* 48000 kHz */
-  {   3428,       1714  }  /* 49000 kHz */
-};
+static uint32_t AnalogMicDmaLength = 0;
+
+#if ADC_RATE_CONTROL == ADC_RATE_FRACTIONAL
+DMA_HandleTypeDef hdma_tim1_up;
+
+/* ARR values of the next periods, two halves of one frame each; refilled as DMA leaves them */
+static uint16_t g_arr_pattern[ADC_SAMPLES_IN_FRAME << 1];
+/* Period in TIM1 clocks, 16.16, and sigma-delta accumulator of its fraction */
+static volatile uint32_t g_period = (ADC_TIM_PERIOD + 1) << 16;
+static uint32_t g_period_acc;
+/* Capture rate loop on fill level, samples per frame */
+static struct um_fb g_rate;
+#endif
 
 /**
   * @brief ADC1 Initialization Function
@@ -72,6 +72,7 @@ static void MX_ADC1_Init(void)
 static void MX_TIM1_Init(void)
 {
   TIM_ClockConfigTypeDef sClockSourceConfig = {0};
+  TIM_SlaveConfigTypeDef sSlaveConfig = {0};
   TIM_MasterConfigTypeDef sMasterConfig = {0};
   TIM_OC_InitTypeDef sConfigOC = {0};
   TIM_BreakDeadTimeConfigTypeDef sBreakDeadTimeConfig = {0};
@@ -79,7 +80,7 @@ static void MX_TIM1_Init(void)
   htim1.Instance = TIM1;
   htim1.Init.Prescaler = 0;
   htim1.Init.CounterMode = TIM_COUNTERMODE_UP;
-  htim1.Init.Period = 3500;
+  htim1.Init.Period = ADC_TIM_PERIOD;
   htim1.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
   htim1.Init.RepetitionCounter = 0;
   htim1.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE;
@@ -90,12 +91,23 @@ static void MX_TIM1_Init(void)
 
   HAL_TIM_PWM_Init(&htim1);
 
+#if ADC_RATE_CONTROL == ADC_RATE_SOF_LOCK
+  /* Locked to USB SOF: TIM2 is reset by SOF (ITR1 remapped to OTG FS SOF, see stm32_audio_feedback_driver)
+   * and its TRGO resets TIM1 (ITR1 is TIM2 TRGO). Frame of the host is split into exactly 48 conversions at
+   * mid-period; only the last period of a frame is longer or shorter by the clock offset of the host */
+  sSlaveConfig.SlaveMode = TIM_SLAVEMODE_RESET;
+  sSlaveConfig.InputTrigger = TIM_TS_ITR1;
+  HAL_TIM_SlaveConfigSynchro(&htim1, &sSlaveConfig);
+#else
+  (void)sSlaveConfig;
+#endif
+
   sMasterConfig.MasterOutputTrigger = TIM_TRGO_RESET;
   sMasterConfig.MasterSlaveMode = TIM_MASTERSLAVEMODE_DISABLE;
   HAL_TIMEx_MasterConfigSynchronization(&htim1, &sMasterConfig);
 
   sConfigOC.OCMode = TIM_OCMODE_PWM1;
-  sConfigOC.Pulse = 1750;
+  sConfigOC.Pulse = ADC_TIM_PULSE;
   sConfigOC.OCPolarity = TIM_OCPOLARITY_HIGH;
   sConfigOC.OCNPolarity = TIM_OCNPOLARITY_HIGH;
   sConfigOC.OCFastMode = TIM_OCFAST_DISABLE;
@@ -132,8 +144,64 @@ static void MX_ADC_PreConfig(void)
   /* DMA2_Stream0_IRQn interrupt configuration */
   HAL_NVIC_SetPriority(DMA2_Stream0_IRQn, 0, 0);
   HAL_NVIC_EnableIRQ(DMA2_Stream0_IRQn);
+
+#if ADC_RATE_CONTROL == ADC_RATE_FRACTIONAL
+  /* DMA2_Stream5_IRQn (TIM1_UP) interrupt configuration */
+  HAL_NVIC_SetPriority(DMA2_Stream5_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA2_Stream5_IRQn);
+#endif
+}
+
+#if ADC_RATE_CONTROL == ADC_RATE_FRACTIONAL
+/* First order sigma-delta: integer period, one clock longer whenever the fraction carries over */
+static void __fill_arr_pattern(uint16_t *arr, uint32_t count)
+{
+  uint32_t period = g_period;
+  uint32_t i;
+
+  for(i = 0; i < count; i++)
+  {
+    g_period_acc += period & 0xFFFF;
+    arr[i] = (uint16_t)((period >> 16) + (g_period_acc >> 16) - 1);
+    g_period_acc &= 0xFFFF;
+  }
+}
+
+static void __arr_half_cplt(DMA_HandleTypeDef *hdma)
+{
+  (void)hdma;
+  __fill_arr_pattern(&g_arr_pattern[0], ADC_SAMPLES_IN_FRAME);
+}
+
+static void __arr_cplt(DMA_HandleTypeDef *hdma)
+{
+  (void)hdma;
+  __fill_arr_pattern(&g_arr_pattern[ADC_SAMPLES_IN_FRAME], ADC_SAMPLES_IN_FRAME);
+}
+
+static void __arr_stop(void)
+{
+  __HAL_TIM_DISABLE_DMA(&htim1, TIM_DMA_UPDATE);
+
+  if(hdma_tim1_up.State == HAL_DMA_STATE_BUSY)
+    HAL_DMA_Abort(&hdma_tim1_up);
 }
 
+/* Pattern is refilled only while its DMA is stopped; timer is stopped too, so ARR is not loaded meanwhile */
+static void __arr_start(void)
+{
+  __arr_stop();
+  __fill_arr_pattern(g_arr_pattern, ARR_SIZE(g_arr_pattern));
+
+  hdma_tim1_up.XferHalfCpltCallback = __arr_half_cplt;
+  hdma_tim1_up.XferCpltCallback = __arr_cplt;
+
+  /* if DMA is not started, ADC keeps sampling with the period, which has been loaded into ARR last */
+  if(HAL_DMA_Start_IT(&hdma_tim1_up, (uint32_t)g_arr_pattern, (uint32_t)&htim1.Instance->ARR, ARR_SIZE(g_arr_pattern)) == HAL_OK)
+    __HAL_TIM_ENABLE_DMA(&htim1, TIM_DMA_UPDATE);
+}
+#endif
+
 /**
   * @brief Ananlog MIC Initialization Function
   * @param None
@@ -146,12 +214,17 @@ void Analog_MIC_Init(void)
   MX_ADC1_Init();
 
   MX_TIM1_Init();
+
+#if ADC_RATE_CONTROL == ADC_RATE_FRACTIONAL
+  um_fb_init_fill(&g_rate, ADC_SAMPLES_IN_FRAME << 16);
+#endif
 }
 
 /**
   * @brief Starts audio stream from a Ananlog MIC for a determined size. 
   * @param pBuffer: Pointer to the buffer 
-  * @param Size: Number of audio data BYTES.
+  * @param Size: Number of audio data BYTES in one of two DMA buffers
+  *        (second one follows the first one in memory).
   * @param Config: DMA_DOUBLE_BUFFER_MODE_ENABLE, DMA_DOUBLE_BUFFER_MODE_DISABLE
   * @retval None
   */
@@ -165,9 +238,12 @@ void Analog_MIC_Start(uint16_t *pBuffer, uint32_t Size, uint8_t Config)
 
     HAL_DMA_Abort(hadc1.DMA_Handle);
 
+    /* one interrupt per buffer; next buffer is set from transfer complete callback */
     hadc1.DMA_Handle->XferM1CpltCallback = hadc1.DMA_Handle->XferCpltCallback;
-    hadc1.DMA_Handle->XferM1HalfCpltCallback = hadc1.DMA_Handle->XferHalfCpltCallback;
+    hadc1.DMA_Handle->XferHalfCpltCallback = NULL;
+    hadc1.DMA_Handle->XferM1HalfCpltCallback = NULL;
 
+    AnalogMicDmaLength = Size >> 1;
     HAL_DMAEx_MultiBufferStart_IT(hadc1.DMA_Handle,
                                   (uint32_t)&(hadc1.Instance->DR),
                                   (uint32_t)pBuffer,
@@ -177,6 +253,10 @@ void Analog_MIC_Start(uint16_t *pBuffer, uint32_t Size, uint8_t Config)
     hadc1.Instance->CR2 |= ADC_CR2_DMA;
   }
 
+#if ADC_RATE_CONTROL == ADC_RATE_FRACTIONAL
+  um_fb_restart(&g_rate);
+  __arr_start();
+#endif
   HAL_TIM_PWM_Start(&htim1, TIM_CHANNEL_1);
 }
 
@@ -188,6 +268,10 @@ void Analog_MIC_Start(uint16_t *pBuffer, uint32_t Size, uint8_t Config)
 void Analog_MIC_Pause(void)
 {
   HAL_TIM_PWM_Stop(&htim1, TIM_CHANNEL_1);
+#if ADC_RATE_CONTROL == ADC_RATE_FRACTIONAL
+  /* ARR DMA is started again by Resume or Start, which refill the pattern */
+  __arr_stop();
+#endif
 }
 
 /**
@@ -197,9 +281,34 @@ void Analog_MIC_Pause(void)
   */
 void Analog_MIC_Resume(void)
 {
+#if ADC_RATE_CONTROL == ADC_RATE_FRACTIONAL
+  /* rate loop goes on from the rate before pause */
+  __arr_start();
+#endif
   HAL_TIM_PWM_Start(&htim1, TIM_CHANNEL_1);
 }
 
+/**
+  * @brief  Sets the buffer, which will be filled after the current one.
+  *         Should be called from Analog_MIC_ConvCpltCallback.
+  * @param  pBuffer: Pointer to the buffer of the same size as passed to Analog_MIC_Start
+  * @retval None
+  */
+void Analog_MIC_SetNextBuffer(uint16_t *pBuffer)
+{
+  DMA_SetNextMemoryAddress(hadc1.DMA_Handle, (uint32_t)pBuffer);
+}
+
+/**
+  * @brief  Returns current position of the audio stream from the Ananlog MIC.
+  * @param  None
+  * @retval Address, where the next converted sample will be stored
+  */
+uint32_t Analog_MIC_GetPosition(void)
+{
+  return DMA_GetCurrentMemoryAddress(hadc1.DMA_Handle, AnalogMicDmaLength);
+}
+
 /**
   * @brief  Stop the audio stream playing from the Ananlog MIC.
   * @param  None 
@@ -208,53 +317,30 @@ void Analog_MIC_Resume(void)
 void Analog_MIC_Stop(void)
 {
   HAL_TIM_PWM_Stop(&htim1, TIM_CHANNEL_1);
+#if ADC_RATE_CONTROL == ADC_RATE_FRACTIONAL
+  __arr_stop();
+#endif
   HAL_ADC_Stop_DMA(&hadc1);
   hadc1.DMA_Handle->Instance->CR &= ~((uint32_t)DMA_SxCR_DBM);
   
 }
 
-void Analog_MIC_adjust_bitrate(uint8_t free_buf_space)
+/**
+  * @brief  Moves sampling rate towards the one, which keeps capture fill level at its target.
+  *         Rate is taken by the next refill of ARR pattern, within a frame.
+  * @param  fill_error: capture fill level minus its target, in samples
+  * @retval None
+  */
+void Analog_MIC_update_fill(int32_t fill_error)
 {
-  if(free_buf_space >= 75)
-  {
-    counter25_idx = 0;
-    counter50_idx = 0;
-    counter75_idx++;
-  }
-  else if(free_buf_space >= 50 && free_buf_space < 75)
-  {
-    counter25_idx = 0;
-    counter50_idx++;
-    counter75_idx = 0;
-  }
-  else if (free_buf_space >= 25 && free_buf_space < 50)
-  {
-    counter25_idx++;
-    counter50_idx = 0;
-    counter75_idx = 0;
-  }
-
-  if(counter25_idx == COUNT_SIZE)
-  {
-    /* increase freq. to 49 kHz */
-    __HAL_TIM_SET_AUTORELOAD(&htim1, period_pulse_table[freq_49000][period]);
-    __HAL_TIM_SET_COMPARE(&htim1, TIM_CHANNEL_1, period_pulse_table[freq_49000][pulse]);
-    counter25_idx = 0;
-  }
-  else if(counter50_idx == COUNT_SIZE)
-  {
-    /* restore 48 kHz */
-    __HAL_TIM_SET_AUTORELOAD(&htim1, period_pulse_table[freq_48000][period]);
-    __HAL_TIM_SET_COMPARE(&htim1, TIM_CHANNEL_1, period_pulse_table[freq_48000][pulse]);
-    counter50_idx = 0;
-  }
-  else if (counter75_idx == COUNT_SIZE)
-  {
-    /* decrease freq. to 47 kHz */
-    __HAL_TIM_SET_AUTORELOAD(&htim1, period_pulse_table[freq_47000][period]);
-    __HAL_TIM_SET_COMPARE(&htim1, TIM_CHANNEL_1, period_pulse_table[freq_47000][pulse]);
-    counter75_idx = 0;
-  }
+#if ADC_RATE_CONTROL == ADC_RATE_FRACTIONAL
+  um_fb_update(&g_rate, fill_error);
+
+  /* clocks per sample, 16.16: clocks in frame over samples in frame */
+  g_period = (uint32_t)(((uint64_t)ADC_TIM_CLOCKS_IN_FRAME << 32) / um_fb_value(&g_rate));
+#else
+  (void)fill_error;
+#endif
 }
 
 __weak void Analog_MIC_ConvCpltCallback(void)
@@ -1,11 +1,27 @@
 #ifndef __STM32_ADC_DRIVER_INIT__
 #define __STM32_ADC_DRIVER_INIT__
 
+#include <stdint.h>
+
+/* ADC sampling clock (TIM1), chosen at build time (make ADC_FRACTIONAL=1):
+ * SOF_LOCK   - TIM1 is reset by SOF through TIM2, each frame holds exactly 48 samples;
+ * FRACTIONAL - TIM1 period is dithered between adjacent values by a sigma-delta modulator (DMA2_Stream5 loads ARR
+ *              on every update), so rate has ppm resolution; it follows capture fill level, TIM2 is not needed */
+#define ADC_RATE_SOF_LOCK       0
+#define ADC_RATE_FRACTIONAL     1
+
+#ifndef ADC_RATE_CONTROL
+#define ADC_RATE_CONTROL        ADC_RATE_SOF_LOCK
+#endif
+
 void Analog_MIC_Init(void);
 void Analog_MIC_Start(uint16_t *pBuffer, uint32_t Size, uint8_t Config);
 void Analog_MIC_Pause(void);
 void Analog_MIC_Resume(void);
 void Analog_MIC_Stop(void);
-void Analog_MIC_adjust_bitrate(uint8_t free_buf_space);
+void Analog_MIC_SetNextBuffer(uint16_t *pBuffer);
+uint32_t Analog_MIC_GetPosition(void);
+/* FRACTIONAL: difference between capture fill level and its target, in samples; once per sent packet */
+void Analog_MIC_update_fill(int32_t fill_error);
 
 #endif /* __STM32_ADC_DRIVER_INIT__ */
@@ -1,5 +1,7 @@
 #include "stm32f4xx_hal.h"
 
+#include "stm32f4xx_hal_msp.h"
+
 #include "stm32_audio_codec_driver.h"
 
 I2C_HandleTypeDef hi2c1;
@@ -8,6 +10,7 @@ DMA_HandleTypeDef hdma_spi2_rx;
 DMA_HandleTypeDef hdma_spi3_tx;
 
 static uint8_t OutputDev = 0;
+static uint32_t AudioDmaLength = 0;
 
 #define CODEC_ADDRESS                   0x94  /* b00100111 */
 #define CODEC_FLAG_TIMEOUT             ((uint32_t)0x1000)
@@ -462,9 +465,12 @@ static void Audio_MAL_Play(uint16_t *Addr, uint32_t Size, uint8_t Config)
     HAL_I2S_DMAPause(&hi2s3);
     HAL_DMA_Abort(hi2s3.hdmatx);
 
+    /* one interrupt per buffer; next buffer is set from transfer complete callback */
     hi2s3.hdmatx->XferM1CpltCallback = hi2s3.hdmatx->XferCpltCallback;
-    hi2s3.hdmatx->XferM1HalfCpltCallback = hi2s3.hdmatx->XferHalfCpltCallback;
+    hi2s3.hdmatx->XferHalfCpltCallback = NULL;
+    hi2s3.hdmatx->XferM1HalfCpltCallback = NULL;
 
+    AudioDmaLength = Size >> 1;
     HAL_DMAEx_MultiBufferStart_IT(hi2s3.hdmatx,
                                   (uint32_t)Addr,
                                   (uint32_t)&hi2s3.Instance->DR,
@@ -548,7 +554,8 @@ uint32_t EVAL_AUDIO_DeInit(void)
 /**
   * @brief Starts playing audio stream from a data buffer for a determined size. 
   * @param pBuffer: Pointer to the buffer 
-  * @param Size: Number of audio data BYTES.
+  * @param Size: Number of audio data BYTES in one of two DMA buffers
+  *        (second one follows the first one in memory).
   * @param Config: DMA_DOUBLE_BUFFER_MODE_ENABLE, DMA_DOUBLE_BUFFER_MODE_DISABLE
   * @retval 0 if correct communication, else wrong communication
   */
@@ -611,6 +618,27 @@ uint32_t EVAL_AUDIO_PauseResume(uint32_t Cmd)
   }
 }
 
+/**
+  * @brief Sets the buffer, which will be played after the current one.
+  *        Should be called from EVAL_AUDIO_CpltCallback.
+  * @param pBuffer: Pointer to the buffer of the same size as passed to EVAL_AUDIO_Play
+  * @retval None
+  */
+void EVAL_AUDIO_SetNextBuffer(uint16_t *pBuffer)
+{
+  DMA_SetNextMemoryAddress(hi2s3.hdmatx, (uint32_t)pBuffer);
+}
+
+/**
+  * @brief Returns current position of the audio stream playing.
+  * @param None
+  * @retval Address of the next sample, which will be sent to the codec
+  */
+uint32_t EVAL_AUDIO_GetPosition(void)
+{
+  return DMA_GetCurrentMemoryAddress(hi2s3.hdmatx, AudioDmaLength);
+}
+
 /**
   * @brief Stops audio playing and Power down the Audio Codec. 
   * @param Option: could be one of the following parameters 
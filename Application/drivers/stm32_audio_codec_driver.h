@@ -34,6 +34,8 @@ uint32_t EVAL_AUDIO_Init(uint16_t OutputDevice, uint8_t Volume,
 uint32_t EVAL_AUDIO_DeInit(void);
 uint32_t EVAL_AUDIO_Play(uint16_t * pBuffer, uint32_t Size, uint8_t Config);
 uint32_t EVAL_AUDIO_PauseResume(uint32_t Cmd);
+void EVAL_AUDIO_SetNextBuffer(uint16_t *pBuffer);
+uint32_t EVAL_AUDIO_GetPosition(void);
 uint32_t EVAL_AUDIO_Stop(uint32_t Option);
 uint32_t EVAL_AUDIO_VolumeCtl(uint8_t Volume);
 uint32_t EVAL_AUDIO_Mute(uint32_t Cmd);
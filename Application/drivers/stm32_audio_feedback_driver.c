@@ -1,31 +1,27 @@
 #include "stm32f4xx_hal.h"
 
 #include "stm32_audio_feedback_driver.h"
+#include "audio_feedback.h"
 
 #define ARR_SIZE(arr)   (sizeof(arr) / sizeof(arr[0]))
 
 #define FB_RATE         8
+/* MCLK is 256 * Fs */
+#define FB_MCLK_SHIFT   8
 
-#define BUFF_FREE_SPACE_UPPER_BOUND     75
-#define BUFF_FREE_SPACE_LOWER_BOUND     25
+static struct um_fb g_fb;
 
+#if FBCK_SOURCE == FBCK_SOURCE_MCLK
 TIM_HandleTypeDef htim2;
 DMA_HandleTypeDef hdma_tim2_ch1;
 
 static uint32_t g_mclk_to_sof_ratios[FB_RATE << 1];
-static bool g_is_feedback_calculated = true;
-static uint32_t g_ideal_bitrate;
 
 static void __fbck_int_enable(void)
 {
     HAL_NVIC_EnableIRQ(DMA1_Stream5_IRQn);
 }
 
-static void __fbck_int_disable(void)
-{
-    HAL_NVIC_DisableIRQ(DMA1_Stream5_IRQn);
-}
-
 static void FBCK_DMA_PreConfig(void)
 {
   __HAL_RCC_DMA1_CLK_ENABLE();
@@ -40,7 +36,7 @@ static void FBCK_DMA_PreConfig(void)
   * @param None
   * @retval None
   */
-void FBCK_Init(uint32_t ideal_bitrate)
+void FBCK_Init(uint32_t nominal)
 {
   TIM_ClockConfigTypeDef sClockSourceConfig = {0};
   TIM_SlaveConfigTypeDef sSlaveConfig = {0};
@@ -69,6 +65,7 @@ void FBCK_Init(uint32_t ideal_bitrate)
   sSlaveConfig.InputTrigger = TIM_TS_ITR1;
   HAL_TIM_SlaveConfigSynchro(&htim2, &sSlaveConfig);
 
+  /* TRGO on every SOF reset: ADC trigger timer (TIM1) is locked to SOF by it */
   sMasterConfig.MasterOutputTrigger = TIM_TRGO_RESET;
   sMasterConfig.MasterSlaveMode = TIM_MASTERSLAVEMODE_DISABLE;
   HAL_TIMEx_MasterConfigSynchronization(&htim2, &sMasterConfig);
@@ -81,65 +78,67 @@ void FBCK_Init(uint32_t ideal_bitrate)
   sConfigIC.ICFilter = 0;
   HAL_TIM_IC_ConfigChannel(&htim2, &sConfigIC, TIM_CHANNEL_1);
 
-  g_ideal_bitrate = ideal_bitrate;
-
+  um_fb_init(&g_fb, nominal, FB_MCLK_SHIFT);
 }
 
 void FBCK_Start(void)
 {
+    um_fb_restart(&g_fb);
     HAL_TIM_IC_Start_DMA(&htim2, TIM_CHANNEL_1, g_mclk_to_sof_ratios, ARR_SIZE(g_mclk_to_sof_ratios));
-    g_is_feedback_calculated = true;
 }
 
 void FBCK_Stop(void)
 {
     HAL_TIM_IC_Stop_DMA(&htim2, TIM_CHANNEL_1);
-    g_is_feedback_calculated = true;
 }
 
-void FBCK_adjust_bitrate(uint8_t free_buf_space)
+void FBCK_update_fill(int32_t fill_error)
 {
-    if(free_buf_space > 100) return;
-    if(free_buf_space >= BUFF_FREE_SPACE_UPPER_BOUND)
-        g_is_feedback_calculated = false;
-    else if(free_buf_space <= BUFF_FREE_SPACE_LOWER_BOUND)
-        g_is_feedback_calculated = true;
+    um_fb_update(&g_fb, fill_error);
 }
+#else
+static uint8_t g_frames_to_send;
 
-void FBCK_int_set(bool enable)
+void FBCK_Init(uint32_t nominal)
 {
-    if(enable)
-    {
-        __fbck_int_enable();
-    }
-    else
-    {
-        __fbck_int_disable();
-    }
+  um_fb_init_fill(&g_fb, nominal);
+}
+
+void FBCK_Start(void)
+{
+    um_fb_restart(&g_fb);
+    g_frames_to_send = 0;
+}
+
+void FBCK_Stop(void)
+{
+}
+
+/* Value is sent every FB_RATE frames, as with MCLK captures */
+void FBCK_update_fill(int32_t fill_error)
+{
+    um_fb_update(&g_fb, fill_error);
+
+    if(++g_frames_to_send < FB_RATE)
+        return;
+
+    g_frames_to_send = 0;
+    if(FBCK_send_feedback) FBCK_send_feedback(um_fb_value(&g_fb));
 }
+#endif
 
 /*=====================================================================*/
 /*======================= INTERNAL FUNCTIONS ==========================*/
 /*=====================================================================*/
 
+#if FBCK_SOURCE == FBCK_SOURCE_MCLK
+
+/* Capture of each SOF is MCLK counted in the frame before it (TIM2 is reset on SOF) */
 static uint32_t __update_mclk_to_sof_ratio(uint8_t start_idx)
 {
-    if(g_is_feedback_calculated)
-    {
-        uint32_t res = 0;
-        uint8_t i = 0;
+    um_fb_add_frames(&g_fb, &g_mclk_to_sof_ratios[start_idx], FB_RATE);
 
-        for(i = 0; i < FB_RATE; i++)
-        {
-            res += g_mclk_to_sof_ratios[start_idx + i];
-        }
-
-        return res;
-    }
-    else
-    {
-        return g_ideal_bitrate;
-    }
+    return um_fb_value(&g_fb);
 }
 
 void HAL_TIM_IC_CaptureHalfCpltCallback(TIM_HandleTypeDef *htim)
@@ -156,4 +155,5 @@ void HAL_TIM_IC_CaptureCallback(TIM_HandleTypeDef *htim)
     {
         if(FBCK_send_feedback) FBCK_send_feedback(__update_mclk_to_sof_ratio(FB_RATE));
     }
-}
\ No newline at end of file
+}
+#endif
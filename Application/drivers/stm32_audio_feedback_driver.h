@@ -5,11 +5,24 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-void FBCK_Init(uint32_t ideal_bitrate);
+/* Source of OUT feedback, chosen at build time (make FBCK_FILL=1):
+ * MCLK - TIM2 counts MCLK (ETR) between SOFs (ITR1), captures are moved by DMA1_Stream5;
+ * FILL - OUT fill level sampled at SOF only, TIM2 and DMA1_Stream5 are left free;
+ *        analog microphone ADC (TIM1) is then not locked to SOF, it runs at 48 kHz of the CPU clock */
+#define FBCK_SOURCE_MCLK    0
+#define FBCK_SOURCE_FILL    1
+
+#ifndef FBCK_SOURCE
+#define FBCK_SOURCE         FBCK_SOURCE_MCLK
+#endif
+
+/* nominal: samples per frame, 16.16; feedback value is sent in this format */
+void FBCK_Init(uint32_t nominal);
 void FBCK_Start(void);
 void FBCK_Stop(void);
-void FBCK_adjust_bitrate(uint8_t free_buf_space);
-void FBCK_int_set(bool enable);
+/* Difference between OUT fill level and its target, in samples:
+ * MCLK - once per received packet; FILL - once per frame at SOF, feedback is sent from here */
+void FBCK_update_fill(int32_t fill_error);
 
 __weak void FBCK_send_feedback(uint32_t feedback);
 
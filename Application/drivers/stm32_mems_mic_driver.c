@@ -1,10 +1,13 @@
 #include "stm32f4xx_hal.h"
+#include "stm32f4xx_hal_msp.h"
 
 #include "stm32_mems_mic_driver.h"
 
 I2S_HandleTypeDef hi2s2;
 DMA_HandleTypeDef hdma_spi2_rx;
 
+static uint32_t MemsMicDmaLength = 0;
+
 static void MEMS_MIC_DMA_PreConfig(void)
 {
   __HAL_RCC_DMA1_CLK_ENABLE();
@@ -38,7 +41,8 @@ void MEMS_MIC_Init(void)
 /**
   * @brief Starts audio stream from a MEMS MIC for a determined size. 
   * @param pBuffer: Pointer to the buffer 
-  * @param Size: Number of audio data BYTES.
+  * @param Size: Number of audio data BYTES in one of two DMA buffers
+  *        (second one follows the first one in memory).
   * @param Config: DMA_DOUBLE_BUFFER_MODE_ENABLE, DMA_DOUBLE_BUFFER_MODE_DISABLE
   * @retval 0 if correct communication, else wrong communication
   */
@@ -52,9 +56,12 @@ void MEMS_MIC_Start(uint16_t *pBuffer, uint32_t Size, uint8_t Config)
         HAL_I2S_DMAPause(&hi2s2);
         HAL_DMA_Abort(hi2s2.hdmarx);
 
+        /* one interrupt per buffer; next buffer is set from transfer complete callback */
         hi2s2.hdmarx->XferM1CpltCallback = hi2s2.hdmarx->XferCpltCallback;
-        hi2s2.hdmarx->XferM1HalfCpltCallback = hi2s2.hdmarx->XferHalfCpltCallback;
+        hi2s2.hdmarx->XferHalfCpltCallback = NULL;
+        hi2s2.hdmarx->XferM1HalfCpltCallback = NULL;
 
+        MemsMicDmaLength = Size >> 1;
         HAL_DMAEx_MultiBufferStart_IT(hi2s2.hdmarx,
                                     (uint32_t)&hi2s2.Instance->DR,
                                     (uint32_t)pBuffer,
@@ -92,6 +99,27 @@ void MEMS_MIC_PauseResume(uint32_t Cmd)
   }
 }
 
+/**
+  * @brief Sets the buffer, which will be filled after the current one.
+  *        Should be called from MEMS_MIC_CpltCallback.
+  * @param pBuffer: Pointer to the buffer of the same size as passed to MEMS_MIC_Start
+  * @retval None
+  */
+void MEMS_MIC_SetNextBuffer(uint16_t *pBuffer)
+{
+  DMA_SetNextMemoryAddress(hi2s2.hdmarx, (uint32_t)pBuffer);
+}
+
+/**
+  * @brief Returns current position of the audio stream from MEMS MIC
+  * @param None
+  * @retval Address, where the next received sample will be stored
+  */
+uint32_t MEMS_MIC_GetPosition(void)
+{
+  return DMA_GetCurrentMemoryAddress(hi2s2.hdmarx, MemsMicDmaLength);
+}
+
 __weak void MEMS_MIC_HalfCpltCallback(void)
 {
 
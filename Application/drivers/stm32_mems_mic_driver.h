@@ -5,5 +5,7 @@ void MEMS_MIC_Init(void);
 void MEMS_MIC_Start(uint16_t *pBuffer, uint32_t Size, uint8_t Config);
 void MEMS_MIC_PauseResume(uint32_t Cmd);
 void MEMS_MIC_Stop(void);
+void MEMS_MIC_SetNextBuffer(uint16_t *pBuffer);
+uint32_t MEMS_MIC_GetPosition(void);
 
 #endif /* __MEMS_MIC_DRIVER__ */
\ No newline at end of file
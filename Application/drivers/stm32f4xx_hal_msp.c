@@ -1,4 +1,6 @@
 #include "stm32f4xx_hal.h"
+#include "stm32_audio_feedback_driver.h"
+#include "stm32_adc_driver.h"
 
 extern DMA_HandleTypeDef hdma_adc1;
 
@@ -6,7 +8,13 @@ extern DMA_HandleTypeDef hdma_spi2_rx;
 
 extern DMA_HandleTypeDef hdma_spi3_tx;
 
+#if FBCK_SOURCE == FBCK_SOURCE_MCLK
 extern DMA_HandleTypeDef hdma_tim2_ch1;
+#endif
+
+#if ADC_RATE_CONTROL == ADC_RATE_FRACTIONAL
+extern DMA_HandleTypeDef hdma_tim1_up;
+#endif
 
 /**
 * @brief I2C MSP Initialization
@@ -261,9 +269,11 @@ void HAL_ADC_MspInit(ADC_HandleTypeDef* hadc)
 */
 void HAL_TIM_Base_MspInit(TIM_HandleTypeDef* htim_base)
 {
-  GPIO_InitTypeDef GPIO_InitStruct = {0};
+#if FBCK_SOURCE == FBCK_SOURCE_MCLK
   if(htim_base->Instance==TIM2)
   {
+    GPIO_InitTypeDef GPIO_InitStruct = {0};
+
     /* Peripheral clock enable */
     __HAL_RCC_TIM2_CLK_ENABLE();
 
@@ -295,10 +305,30 @@ void HAL_TIM_Base_MspInit(TIM_HandleTypeDef* htim_base)
     __HAL_LINKDMA(htim_base,hdma[TIM_DMA_ID_CC1],hdma_tim2_ch1);
 
   }
-  else if(htim_base->Instance==TIM1)
+  else
+#endif
+  if(htim_base->Instance==TIM1)
   {
     /* Peripheral clock enable */
     __HAL_RCC_TIM1_CLK_ENABLE();
+
+#if ADC_RATE_CONTROL == ADC_RATE_FRACTIONAL
+    /* TIM1 DMA Init */
+    /* TIM1_UP Init: next period of the ADC trigger is written to ARR on every update */
+    hdma_tim1_up.Instance = DMA2_Stream5;
+    hdma_tim1_up.Init.Channel = DMA_CHANNEL_6;
+    hdma_tim1_up.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    hdma_tim1_up.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_tim1_up.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_tim1_up.Init.PeriphDataAlignment = DMA_PDATAALIGN_HALFWORD;
+    hdma_tim1_up.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+    hdma_tim1_up.Init.Mode = DMA_CIRCULAR;
+    hdma_tim1_up.Init.Priority = DMA_PRIORITY_HIGH;
+    hdma_tim1_up.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    HAL_DMA_Init(&hdma_tim1_up);
+
+    __HAL_LINKDMA(htim_base,hdma[TIM_DMA_ID_UPDATE],hdma_tim1_up);
+#endif
   }
 }
 
@@ -341,3 +371,37 @@ void HAL_TIM_Base_MspDeInit(TIM_HandleTypeDef* htim_base)
   }
 
 }
+
+/**
+* @brief Returns address of the memory, which DMA stream is going to access next
+*        in double buffer mode
+* @param hdma: DMA handle pointer
+* @param Length: Number of data items in one memory buffer
+* @retval Memory address
+*/
+uint32_t DMA_GetCurrentMemoryAddress(DMA_HandleTypeDef *hdma, uint32_t Length)
+{
+  uint32_t ndtr, cr;
+
+  /* NDTR is reloaded together with CT toggle; re-read if reload happened in between */
+  do
+  {
+    ndtr = hdma->Instance->NDTR;
+    cr = hdma->Instance->CR;
+  } while(hdma->Instance->NDTR > ndtr);
+
+  return ((cr & DMA_SxCR_CT) ? hdma->Instance->M1AR : hdma->Instance->M0AR)
+    + ((Length - ndtr) << ((cr & DMA_SxCR_PSIZE) >> DMA_SxCR_PSIZE_Pos));
+}
+
+/**
+* @brief Points the memory, which is not in use by DMA stream in double buffer mode,
+*        to the new address. Should be called from transfer complete interrupt
+* @param hdma: DMA handle pointer
+* @param Address: New memory address
+* @retval None
+*/
+void DMA_SetNextMemoryAddress(DMA_HandleTypeDef *hdma, uint32_t Address)
+{
+  HAL_DMAEx_ChangeMemory(hdma, Address, (hdma->Instance->CR & DMA_SxCR_CT) ? MEMORY0 : MEMORY1);
+}
@@ -4,5 +4,7 @@
 #include "stm32f4xx_hal.h"
 
 void HAL_TIM_MspPostInit(TIM_HandleTypeDef* htim);
+uint32_t DMA_GetCurrentMemoryAddress(DMA_HandleTypeDef *hdma, uint32_t Length);
+void DMA_SetNextMemoryAddress(DMA_HandleTypeDef *hdma, uint32_t Address);
 
 #endif /* __STM32F4XX_HAL_MSP__ */
\ No newline at end of file
@@ -0,0 +1,153 @@
+#include "audio_asrc.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* Fill error low pass filter, (1 / 16) per packet */
+#define UM_ASRC_ERROR_FILTER_SHIFT          4
+/* Proportional gain, 2^14 Q32 units (~3.8 ppm) per sample of fill error */
+#define UM_ASRC_KP_SHIFT                    14
+/* Integral gain, 1 Q32 unit per sample of fill error per packet */
+#define UM_ASRC_KI_SHIFT                    0
+
+#define UM_ASRC_ERROR_FRAC_BITS             8
+#define UM_ASRC_INTEGRAL_FRAC_BITS          4
+
+/* Kaiser (beta 7) windowed sinc; row p is for fractional position p / UM_ASRC_PHASES, Q15.
+ * Each row is normalised to unity DC gain; sum of absolute values is below 2.0,
+ * so FIR of 16 bit samples fits into 32 bit accumulator */
+static const int16_t um_asrc_coef[UM_ASRC_PHASES + 1][UM_ASRC_TAPS] =
+{
+    /*  0/32 */ {      0,      0,      0,      0,      0,      0,      0,  32767,      0,      0,      0,      0,      0,      0,      0,      0 },
+    /*  1/32 */ {     -6,     19,    -49,    106,   -208,    407,   -939,  32715,   1006,   -426,    217,   -110,     51,    -20,      6,     -1 },
+    /*  2/32 */ {    -11,     37,    -95,    205,   -406,    793,  -1808,  32552,   2076,   -866,    441,   -224,    105,    -42,     13,     -2 },
+    /*  3/32 */ {    -15,     53,   -137,    299,   -592,   1154,  -2605,  32283,   3205,  -1318,    670,   -341,    160,    -65,     20,     -3 },
+    /*  4/32 */ {    -19,     68,   -176,    385,   -765,   1489,  -3327,  31909,   4388,  -1778,    902,   -460,    217,    -88,     27,     -4 },
+    /*  5/32 */ {    -22,     81,   -211,    464,   -923,   1795,  -3973,  31431,   5621,  -2241,   1134,   -579,    274,   -112,     35,     -6 },
+    /*  6/32 */ {    -25,     92,   -242,    534,  -1065,   2070,  -4542,  30853,   6898,  -2702,   1364,   -698,    331,   -136,     43,     -7 },
+    /*  7/32 */ {    -27,    101,   -269,    596,  -1192,   2314,  -5034,  30179,   8212,  -3158,   1590,   -814,    388,   -160,     51,     -9 },
+    /*  8/32 */ {    -28,    109,   -292,    650,  -1301,   2525,  -5450,  29411,   9558,  -3603,   1809,   -927,    443,   -184,     59,    -11 },
+    /*  9/32 */ {    -30,    115,   -311,    694,  -1393,   2702,  -5789,  28556,  10929,  -4033,   2019,  -1036,    497,   -207,     68,    -13 },
+    /* 10/32 */ {    -30,    120,   -325,    729,  -1467,   2846,  -6053,  27617,  12317,  -4443,   2217,  -1139,    548,   -230,     76,    -15 },
+    /* 11/32 */ {    -30,    122,   -336,    756,  -1524,   2956,  -6245,  26604,  13716,  -4828,   2400,  -1234,    595,   -251,     84,    -17 },
+    /* 12/32 */ {    -30,    124,   -342,    774,  -1564,   3032,  -6365,  25517,  15117,  -5182,   2567,  -1320,    639,   -271,     91,    -19 },
+    /* 13/32 */ {    -29,    123,   -344,    783,  -1586,   3075,  -6418,  24368,  16514,  -5501,   2714,  -1397,    678,   -289,     98,    -21 },
+    /* 14/32 */ {    -29,    122,   -343,    784,  -1592,   3086,  -6405,  23160,  17899,  -5780,   2840,  -1463,    712,   -306,    105,    -22 },
+    /* 15/32 */ {    -27,    119,   -338,    776,  -1582,   3067,  -6331,  21901,  19264,  -6015,   2942,  -1516,    740,   -319,    111,    -24 },
+    /* 16/32 */ {    -26,    115,   -330,    762,  -1556,   3019,  -6200,  20600,  20600,  -6200,   3019,  -1556,    762,   -330,    115,    -26 },
+    /* 17/32 */ {    -24,    111,   -319,    740,  -1516,   2942,  -6015,  19264,  21901,  -6331,   3067,  -1582,    776,   -338,    119,    -27 },
+    /* 18/32 */ {    -22,    105,   -306,    712,  -1463,   2840,  -5780,  17899,  23160,  -6405,   3086,  -1592,    784,   -343,    122,    -29 },
+    /* 19/32 */ {    -21,     98,   -289,    678,  -1397,   2714,  -5501,  16514,  24368,  -6418,   3075,  -1586,    783,   -344,    123,    -29 },
+    /* 20/32 */ {    -19,     91,   -271,    639,  -1320,   2567,  -5182,  15117,  25517,  -6365,   3032,  -1564,    774,   -342,    124,    -30 },
+    /* 21/32 */ {    -17,     84,   -251,    595,  -1234,   2400,  -4828,  13716,  26604,  -6245,   2956,  -1524,    756,   -336,    122,    -30 },
+    /* 22/32 */ {    -15,     76,   -230,    548,  -1139,   2217,  -4443,  12317,  27617,  -6053,   2846,  -1467,    729,   -325,    120,    -30 },
+    /* 23/32 */ {    -13,     68,   -207,    497,  -1036,   2019,  -4033,  10929,  28556,  -5789,   2702,  -1393,    694,   -311,    115,    -30 },
+    /* 24/32 */ {    -11,     59,   -184,    443,   -927,   1809,  -3603,   9558,  29411,  -5450,   2525,  -1301,    650,   -292,    109,    -28 },
+    /* 25/32 */ {     -9,     51,   -160,    388,   -814,   1590,  -3158,   8212,  30179,  -5034,   2314,  -1192,    596,   -269,    101,    -27 },
+    /* 26/32 */ {     -7,     43,   -136,    331,   -698,   1364,  -2702,   6898,  30853,  -4542,   2070,  -1065,    534,   -242,     92,    -25 },
+    /* 27/32 */ {     -6,     35,   -112,    274,   -579,   1134,  -2241,   5621,  31431,  -3973,   1795,   -923,    464,   -211,     81,    -22 },
+    /* 28/32 */ {     -4,     27,    -88,    217,   -460,    902,  -1778,   4388,  31909,  -3327,   1489,   -765,    385,   -176,     68,    -19 },
+    /* 29/32 */ {     -3,     20,    -65,    160,   -341,    670,  -1318,   3205,  32283,  -2605,   1154,   -592,    299,   -137,     53,    -15 },
+    /* 30/32 */ {     -2,     13,    -42,    105,   -224,    441,   -866,   2076,  32552,  -1808,    793,   -406,    205,    -95,     37,    -11 },
+    /* 31/32 */ {     -1,      6,    -20,     51,   -110,    217,   -426,   1006,  32715,   -939,    407,   -208,    106,    -49,     19,     -6 },
+    /* 32/32 */ {      0,      0,      0,      0,      0,      0,      0,      0,  32767,      0,      0,      0,      0,      0,      0,      0 }
+};
+
+static inline int32_t um_asrc_clamp(int32_t value, int32_t limit)
+{
+    return value > limit ? limit : (value < -limit ? -limit : value);
+}
+
+static inline int16_t um_asrc_saturate(int32_t value)
+{
+    return value > INT16_MAX ? INT16_MAX : (value < INT16_MIN ? INT16_MIN : (int16_t)value);
+}
+
+void um_asrc_init(struct um_asrc *asrc, uint32_t channels, int16_t *history)
+{
+    asrc->channels = channels;
+    asrc->step_delta = 0;
+    asrc->integral = 0;
+
+    um_asrc_restart(asrc, history);
+}
+
+void um_asrc_restart(struct um_asrc *asrc, int16_t *history)
+{
+    /* output sample is in the middle of the taps */
+    asrc->position = (uint64_t)(UM_ASRC_TAPS >> 1) << 32;
+    asrc->error = 0;
+
+    memset(history, 0, UM_ASRC_TAPS * asrc->channels * sizeof(int16_t));
+}
+
+uint32_t um_asrc_process(struct um_asrc *asrc, int16_t *in, uint32_t in_samples,
+                         uint8_t *out, uint32_t out_offset, uint32_t out_size)
+{
+    uint32_t channels = asrc->channels;
+    uint64_t step = (uint64_t)((int64_t)(1ULL << 32) + asrc->step_delta);
+    uint64_t position = asrc->position;
+    /* last tap of output sample should be in the packet */
+    uint64_t end = (uint64_t)(in_samples + (UM_ASRC_TAPS >> 1)) << 32;
+    uint32_t count = 0;
+    int32_t coef[UM_ASRC_TAPS];
+
+    while(position < end)
+    {
+        uint32_t frac = (uint32_t)position;
+        uint32_t phase = frac >> (32 - UM_ASRC_PHASE_BITS);
+        const int16_t *row = um_asrc_coef[phase];
+        const int16_t *next_row = um_asrc_coef[phase + 1];
+        int32_t weight = (frac >> (32 - UM_ASRC_PHASE_BITS - 15)) & 0x7FFF;
+        const int16_t *x = in + ((uint32_t)(position >> 32) + 1 - (UM_ASRC_TAPS >> 1)) * channels;
+        int16_t *y = (int16_t *)(out + out_offset);
+        uint32_t i, ch;
+
+        /* coefficients between two neighbour phases are shared by all channels */
+        for(i = 0; i < UM_ASRC_TAPS; i++)
+        {
+            coef[i] = row[i] + ((((next_row[i] - row[i]) * weight) + (1 << 14)) >> 15);
+        }
+
+        for(ch = 0; ch < channels; ch++)
+        {
+            int32_t acc = 1 << 14;
+
+            for(i = 0; i < UM_ASRC_TAPS; i++)
+            {
+                acc += coef[i] * x[(i * channels) + ch];
+            }
+            y[ch] = um_asrc_saturate(acc >> 15);
+        }
+
+        out_offset += channels * sizeof(int16_t);
+        if(out_offset == out_size)
+            out_offset = 0;
+
+        position += step;
+        count++;
+    }
+
+    /* the end of this packet is the history of the next one */
+    asrc->position = position - ((uint64_t)in_samples << 32);
+    memmove(in, in + (in_samples * channels), UM_ASRC_TAPS * channels * sizeof(int16_t));
+
+    return count;
+}
+
+void um_asrc_update(struct um_asrc *asrc, int32_t fill_error)
+{
+    int32_t limit = UM_ASRC_MAX_STEP_DELTA;
+
+    asrc->error += ((fill_error * (1 << UM_ASRC_ERROR_FRAC_BITS)) - asrc->error) >> UM_ASRC_ERROR_FILTER_SHIFT;
+
+    /* integral is limited to the same range as output, so it does not wind up during xruns */
+    asrc->integral += asrc->error >> (UM_ASRC_ERROR_FRAC_BITS - UM_ASRC_INTEGRAL_FRAC_BITS);
+    asrc->integral = um_asrc_clamp(asrc->integral,
+        (limit >> UM_ASRC_KI_SHIFT) << UM_ASRC_INTEGRAL_FRAC_BITS);
+
+    /* more data than target: read input faster */
+    asrc->step_delta = um_asrc_clamp(
+        (asrc->error * (1 << (UM_ASRC_KP_SHIFT - UM_ASRC_ERROR_FRAC_BITS))) +
+        ((asrc->integral >> UM_ASRC_INTEGRAL_FRAC_BITS) * (1 << UM_ASRC_KI_SHIFT)), limit);
+}
@@ -0,0 +1,50 @@
+#ifndef __AUDIO_ASRC_INIT___
+#define __AUDIO_ASRC_INIT___
+
+#include <stdint.h>
+
+/* Fractional resampler of 16 bit interleaved PCM, used by UM_BUFFER_CONFIG_CA_ASRC.
+ * Output sample is FIR of UM_ASRC_TAPS input samples; coefficients of one of UM_ASRC_PHASES
+ * windowed sinc phases are linearly interpolated by fractional position.
+ * One output sample of stereo stream costs about 50 multiplications, so 1 ms of 48 kHz audio
+ * takes a few thousands of cycles on Cortex-M4 */
+#define UM_ASRC_TAPS                        16
+#define UM_ASRC_PHASE_BITS                  5
+#define UM_ASRC_PHASES                      (1 << UM_ASRC_PHASE_BITS)
+#define UM_ASRC_MAX_CHANNELS                2
+
+/* Ratio of input to output rate is steered within +-2000 ppm (Q32) */
+#define UM_ASRC_MAX_STEP_DELTA              8589935
+
+/* Input samples kept from previous packet in front of the new one */
+#define UM_ASRC_HISTORY_SIZE(sample_size)   (UM_ASRC_TAPS * (sample_size))
+
+struct um_asrc
+{
+    /* Q32.32 position of next output sample in [ history | packet ] */
+    uint64_t position;
+    /* deviation of input to output rate ratio from 1.0, Q32 */
+    int32_t step_delta;
+
+    /* PI controller state: low pass filtered fill error in samples (Q8) and its integral (Q4) */
+    int32_t error;
+    int32_t integral;
+
+    uint8_t channels;
+};
+
+void um_asrc_init(struct um_asrc *asrc, uint32_t channels, int16_t *history);
+
+/* Drops history and position; rate ratio learned by controller is kept */
+void um_asrc_restart(struct um_asrc *asrc, int16_t *history);
+
+/* Resamples in_samples which follow UM_ASRC_TAPS samples of history in the "in" buffer.
+ * Output goes to ring "out" of out_size bytes starting from out_offset.
+ * Returns count of output samples, in_samples +-1 */
+uint32_t um_asrc_process(struct um_asrc *asrc, int16_t *in, uint32_t in_samples,
+                         uint8_t *out, uint32_t out_offset, uint32_t out_size);
+
+/* Feeds controller with difference between fill level and its target, in samples */
+void um_asrc_update(struct um_asrc *asrc, int32_t fill_error);
+
+#endif
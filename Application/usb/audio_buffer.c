@@ -2,21 +2,46 @@
 
 #include <stdint.h>
 #include <string.h>
-#include <stdlib.h>
 
 #define UM_BUFFER_LISTENER_COUNT            4
 
+/* Side of the watermark, which level has been reported on */
+#define UM_WATERMARK_UNKNOWN                0
+#define UM_WATERMARK_BELOW                  1
+#define UM_WATERMARK_ABOVE                  2
+
+/* CA_STRETCH: fill error low pass filter, (1 / 16) per packet */
+#define UM_STRETCH_FILTER_SHIFT             4
+#define UM_STRETCH_ERROR_FRAC_BITS          8
+/* CA_FEEDBACK of IN: filtered fill error (same filter), which packet size is corrected beyond, in frames;
+ * it keeps USB timing jitter from toggling packet sizes */
+#define UM_ASYNC_IN_DEADBAND                4
+
 struct um_buffer_listener
 {
     uint32_t id;
 
     void (*listener_handle)(void *args);
     struct um_buffer_listener *next;
+
+    /* UM_LISTENER_TYPE_WATERMARK only */
+    uint8_t watermark;
+    uint8_t hysteresis;
+    uint8_t side;
+    uint16_t min_interval;
+    uint32_t last_event;
 };
 
 static struct um_buffer_listener _listener_pool[UM_LISTENER_TYPE_COUNT][UM_BUFFER_LISTENER_COUNT] =
 {
     /* UM_LISTENER_TYPE_CA */
+    {
+        {.id = 0, .listener_handle = NULL, .next = NULL},
+        {.id = 1, .listener_handle = NULL, .next = NULL},
+        {.id = 2, .listener_handle = NULL, .next = NULL},
+        {.id = 3, .listener_handle = NULL, .next = NULL}
+    },
+    /* UM_LISTENER_TYPE_WATERMARK */
     {
         {.id = 0, .listener_handle = NULL, .next = NULL},
         {.id = 1, .listener_handle = NULL, .next = NULL},
@@ -25,431 +50,1171 @@ static struct um_buffer_listener _listener_pool[UM_LISTENER_TYPE_COUNT][UM_BUFFE
     }
 };
 
-static struct um_node** _alloc_um_nodes(struct um_buffer_handle *handle, struct um_node **prev)
+static struct um_buffer_listener* _get_last_listener(struct um_buffer_listener* current)
 {
-    static int recursion_count = 0;
+    if(current->next != NULL)
+        return _get_last_listener(current->next);
+    else
+        return current;
+}
 
-    *prev = (struct um_node *)malloc(sizeof(struct um_node));
+static uint32_t allocate_listeners_from_pool(enum um_buffer_listener_type type)
+{
+    uint32_t i = 0;
 
-    if(*prev == NULL)
-        return NULL;
+    for(i = 0; i < UM_BUFFER_LISTENER_COUNT; i++)
+    {
+        if(_listener_pool[type][i].listener_handle == NULL)
+        {
+            return i;
+        }
+    }
+    return UM_LISTENERS_WRONG_ID;
+}
 
-    (*prev)->um_buf = handle->congestion_avoidance_bucket + (handle->um_usb_frame_in_node * handle->um_usb_packet_size * recursion_count);
+static uint32_t add_listener(struct um_buffer_handle *handle, enum um_buffer_listener_type type, listener_callback clbk)
+{
+    uint32_t result = allocate_listeners_from_pool(type);
 
-    (*prev)->um_node_state = UM_NODE_STATE_INITIAL;
-    (*prev)->um_node_offset = 0;
+    UM_RET_IF_FALSE(result != UM_LISTENERS_WRONG_ID, UM_LISTENERS_WRONG_ID);
 
-    if(recursion_count != (handle->um_number_of_nodes - 1)) {
-        recursion_count++;
-        return _alloc_um_nodes(handle, &((*prev)->next));
-    } else {
-        recursion_count = 0;
-        return prev;
+    if(handle->listeners[type] == NULL)
+    {
+        handle->listeners[type] = &(_listener_pool[type][result]);
+        handle->listeners[type]->listener_handle = clbk;
     }
+    else
+    {
+        struct um_buffer_listener *last = _get_last_listener(handle->listeners[type]);
+        last->next = &(_listener_pool[type][result]);
+        last->next->listener_handle = clbk;
+    }
+
+    return result;
 }
 
-static void _free_um_nodes(struct um_node *current, struct um_node *start)
+/* um_conceal_state: which DMA memory holds the conceal node, whether it is not silent,
+ * and whether the rest of stopped stream has been dropped in standby */
+#define UM_CONCEAL_PLAYING      0x1
+#define UM_CONCEAL_QUEUED       0x2
+#define UM_CONCEAL_FADED        0x4
+#define UM_CONCEAL_DROPPED      0x8
+
+/* Stream parameters, which per packet paths depend on. Generic API reads them from the handle;
+ * fast paths of UM_STREAMS pass compile time constants, so their branches and divisions are folded */
+struct um_geometry
+{
+    uint8_t ca;
+    uint8_t dir;
+    uint32_t packet_size;
+    uint32_t sample_size;
+    uint32_t node_size;
+};
+
+#define UM_HANDLE_GEOMETRY(handle) ((struct um_geometry){                                             \
+    GET_CONFIG_CA_ALGORITM((handle)->um_buffer_config), GET_CONFIG_DIR((handle)->um_buffer_config),   \
+    (handle)->um_usb_packet_size, (handle)->um_sample_size, (handle)->um_node_size })
+
+/* Per packet helper: it is inlined into each caller to be specialised on caller's geometry */
+#define UM_HOT                  static inline __attribute__((always_inline))
+
+static inline uint32_t um_hw_node(struct um_buffer_handle *handle)
 {
-    if(current != start)
+    uint32_t hw_node = handle->cur_um_node_for_hw;
+
+    /* node index of other context should be read before node content (and before conceal state) */
+    UM_DMB();
+
+    /* while conceal node is played, the last played node is free already */
+    if(handle->um_conceal_state & UM_CONCEAL_PLAYING)
+        hw_node++;
+
+    return hw_node;
+}
+
+UM_HOT uint8_t um_usb_node_can_advance(struct um_buffer_handle *handle, uint32_t count, const struct um_geometry g)
+{
+    uint32_t next_node = handle->cur_um_node_for_usb + count;
+    uint32_t hw_node = um_hw_node(handle);
+
+    if(g.dir == UM_BUFFER_CONFIG_DIR_IN)
+    {
+        /* next node should be already filled by hardware */
+        return (int32_t)(hw_node - next_node) > 0;
+    }
+    else
     {
-        _free_um_nodes(current->next, start);
+        /* next node should not be under hardware */
+        return (next_node - hw_node) < handle->um_number_of_nodes;
     }
-    free(current);
 }
 
-static struct um_buffer_listener* _get_last_listener(struct um_buffer_listener* current)
+static inline void um_usb_node_finished(struct um_buffer_handle *handle, uint32_t count)
 {
-    if(current->next != NULL)
-        return _get_last_listener(current->next);
+    /* node content should be visible for other context before node index */
+    UM_DMB();
+    handle->cur_um_node_for_usb += count;
+}
+
+UM_HOT uint32_t get_hw_progress(struct um_buffer_handle *handle, uint32_t hw_node, const struct um_geometry g)
+{
+    uint32_t total = g.node_size * handle->um_number_of_nodes;
+    int32_t progress;
+
+    if(handle->um_hw_position == NULL || handle->um_buffer_state != UM_BUFFER_STATE_PLAY)
+        return 0;
+
+    /* DMA is in conceal node; hw_node has not been started yet */
+    if(handle->um_conceal_state & UM_CONCEAL_PLAYING)
+        return 0;
+
+    /* hardware position is read after node index, so it is never behind the node start */
+    progress = (int32_t)(handle->um_hw_position() - UM_ADDR(handle->um_buffer)) - (int32_t)((hw_node & handle->um_node_mask) * g.node_size);
+    if(progress < 0)
+        progress += total;
+
+    /* DMA is not in the ring (e.g. not started yet) */
+    return (uint32_t)progress < total ? (uint32_t)progress : 0;
+}
+
+UM_HOT uint32_t get_fill_bytes(struct um_buffer_handle *handle, const struct um_geometry g)
+{
+    uint32_t hw_node = um_hw_node(handle);
+    /* HW position is node start plus DMA progress inside the node, if known; USB position is tracked in bytes */
+    int32_t fill = (int32_t)(handle->um_usb_bytes - (hw_node * g.node_size) - get_hw_progress(handle, hw_node, g));
+
+    if(g.dir == UM_BUFFER_CONFIG_DIR_IN)
+        fill = -fill;
+
+    /* hardware has already passed USB side; under/overflow is handled in interrupt */
+    return fill < 0 ? 0 : (uint32_t)fill;
+}
+
+/* Percentage of the buffer available for USB side: free space for OUT, data ready to send for IN */
+static uint32_t get_free_buffer_persentage(struct um_buffer_handle *handle, const struct um_geometry g)
+{
+    /* scale is twice the target fill, so target is always seen as 50% */
+    uint32_t total = handle->um_target_fill << 1;
+    uint32_t fill = get_fill_bytes(handle, g);
+
+    fill = fill > total ? total : fill;
+
+    if(g.dir == UM_BUFFER_CONFIG_DIR_IN)
+        return (fill * 100) / total;
     else
-        return current;
+        return ((total - fill) * 100) / total;
 }
 
-static uint32_t allocate_listeners_from_pool(enum um_buffer_listener_type type)
+/* Stream is (re)started: first level outside of hysteresis band is reported in any direction */
+static void reset_watermarks(struct um_buffer_handle *handle)
 {
-    uint32_t i = 0;
+    struct um_buffer_listener *listener = handle->listeners[UM_LISTENER_TYPE_WATERMARK];
 
-    for(i = 0; i < UM_BUFFER_LISTENER_COUNT; i++)
+    for(; listener != NULL; listener = listener->next)
     {
-        if(_listener_pool[type][i].listener_handle == NULL)
-        {
-            return i;
-        }
+        listener->side = UM_WATERMARK_UNKNOWN;
     }
-    return UM_LISTENERS_WRONG_ID;
 }
 
-static uint8_t get_congestion_window(struct um_node *um_node_write)
+/* Called once per packet in PLAY state. CA listeners get every level;
+ * watermark listeners only crossings, not more often than once per min_interval packets */
+UM_HOT void notify_listeners(struct um_buffer_handle *handle, const struct um_geometry g)
 {
-    return um_node_write->um_node_state != UM_NODE_STATE_HW_FINISHED ? 1 : 1 + get_congestion_window(um_node_write->next);
+    struct um_buffer_listener *listener = handle->listeners[UM_LISTENER_TYPE_CA];
+    uint32_t level;
+
+    handle->um_packet_count++;
+
+    if(listener == NULL && handle->listeners[UM_LISTENER_TYPE_WATERMARK] == NULL)
+        return;
+
+    level = get_free_buffer_persentage(handle, g);
+
+    for(; listener != NULL; listener = listener->next)
+    {
+        listener->listener_handle((void *)&level);
+    }
+
+    for(listener = handle->listeners[UM_LISTENER_TYPE_WATERMARK]; listener != NULL; listener = listener->next)
+    {
+        struct um_watermark_event event;
+
+        if((handle->um_packet_count - listener->last_event) < listener->min_interval)
+            continue;
+
+        if(listener->side != UM_WATERMARK_ABOVE && level >= listener->watermark)
+            listener->side = UM_WATERMARK_ABOVE;
+        else if(listener->side != UM_WATERMARK_BELOW && level + listener->hysteresis <= listener->watermark)
+            listener->side = UM_WATERMARK_BELOW;
+        else
+            continue;
+
+        listener->last_event = handle->um_packet_count;
+
+        event.watermark = listener->watermark;
+        event.level = level;
+        event.rising = listener->side == UM_WATERMARK_ABOVE;
+        listener->listener_handle((void *)&event);
+    }
+}
+
+static void reset_usb_position(struct um_buffer_handle *handle, uint32_t node)
+{
+    handle->cur_um_node_for_usb = node;
+    handle->um_usb_node_offset = 0;
+    handle->um_usb_bytes = node * handle->um_node_size;
+    handle->um_abs_offset = (node & handle->um_node_mask) * handle->um_buffer_size_in_one_node;
+    handle->um_buffer_flags = 0;
+    handle->um_fill_error = 0;
 }
 
-static uint32_t get_free_buffer_persentage(struct um_buffer_handle *handle)
+/* Byte offset of USB position inside the current node */
+UM_HOT uint32_t usb_node_offset_bytes(struct um_buffer_handle *handle, const struct um_geometry g)
 {
-    uint8_t i;
-    struct um_node *curr;
-    uint32_t result = 0;
+    return g.ca == UM_BUFFER_CONFIG_CA_NONE ?
+        handle->um_usb_node_offset * g.packet_size :
+        handle->um_usb_node_offset;
+}
+
+/* Where the next OUT packet is received to */
+UM_HOT uint8_t *usb_write_ptr(struct um_buffer_handle *handle, const struct um_geometry g)
+{
+    if(g.ca == UM_BUFFER_CONFIG_CA_ASRC)
+        return handle->congestion_avoidance_bucket + UM_ASRC_HISTORY_SIZE(g.sample_size);
+
+    return UM_CUR_NODE_FOR_USB(handle)->um_buf + usb_node_offset_bytes(handle, g);
+}
+
+/* Node, which USB position would be in after writing bytes, should not be under hardware */
+UM_HOT uint8_t um_usb_has_room(struct um_buffer_handle *handle, uint32_t bytes, const struct um_geometry g)
+{
+    uint32_t nodes = (usb_node_offset_bytes(handle, g) + bytes) / g.node_size;
 
-    for(i = 0, curr = handle->cur_um_node_for_usb;
-        i < handle->um_number_of_nodes;
-        i++, curr = curr->next)
+    return nodes == 0 || um_usb_node_can_advance(handle, nodes, g);
+}
+
+/* Moves USB position of byte counted modes; with small nodes one packet may cover more than one node */
+UM_HOT void um_usb_advance_bytes(struct um_buffer_handle *handle, uint32_t bytes, const struct um_geometry g)
+{
+    handle->um_usb_node_offset += bytes;
+    handle->um_usb_bytes += bytes;
+    handle->um_abs_offset += bytes;
+
+    if(handle->um_abs_offset >= handle->total_buffer_size)
+        handle->um_abs_offset -= handle->total_buffer_size;
+
+    /* node is counted in bytes in these modes */
+    if(handle->um_usb_node_offset >= g.node_size)
     {
-        if(curr->um_node_state == UM_NODE_STATE_UNDER_HW)
-        {
-            return (result * 100) / handle->um_number_of_nodes;
-        }
+        uint32_t nodes = handle->um_usb_node_offset / g.node_size;
 
-        result++;
+        handle->um_usb_node_offset -= nodes * g.node_size;
+        um_usb_node_finished(handle, nodes);
     }
-
-    return (result * 100) / handle->um_number_of_nodes;
 }
 
-static void reset_nodes_states_to_default(struct um_buffer_handle *handle)
+/* Correction starts, when filtered fill error is above half of the packet,
+ * and lasts until it is back within 1/8 of the packet */
+UM_HOT void update_stretch_squeeze(struct um_buffer_handle *handle, const struct um_geometry g)
 {
-    struct um_node *node = handle->start_um_node;
+    int32_t error = ((int32_t)get_fill_bytes(handle, g) - (int32_t)handle->um_target_fill) / (int32_t)g.sample_size;
+    uint32_t packet_samples = g.packet_size / g.sample_size;
+    uint32_t level;
 
-    do{
-        node->um_node_offset = 0;
-        node->um_node_state = UM_NODE_STATE_INITIAL;
-        node = node->next;
-    }while(node != handle->start_um_node);
+    handle->um_fill_error += ((error * (1 << UM_STRETCH_ERROR_FRAC_BITS)) - handle->um_fill_error) >> UM_STRETCH_FILTER_SHIFT;
+    level = (uint32_t)(handle->um_fill_error < 0 ? -handle->um_fill_error : handle->um_fill_error) >> UM_STRETCH_ERROR_FRAC_BITS;
 
-    handle->cur_um_node_for_hw = handle->cur_um_node_for_usb = handle->start_um_node;
-    handle->um_abs_offset = 0;
-    handle->um_buffer_state = UM_BUFFER_STATE_READY;
+    if(GET_CONGESTION_AVOIDANCE_FLAG(handle->um_buffer_flags) ?
+        level <= (packet_samples >> 3) :
+        level >= (packet_samples >> 1))
+    {
+        TOGGLE_CONGESTION_AVOIDANCE_FLAG(handle->um_buffer_flags);
+    }
 }
 
-int um_handle_init( struct um_buffer_handle *handle,
-                    uint32_t usb_packet_size,
-                    uint32_t usb_frame_in_um_node_count,
-                    uint32_t um_node_count,
-                    uint8_t config,
-                    um_play_fnc play, um_pause_resume_fnc pause_resume )
+/* Quietest of frames [first, last), which are contiguous from x on: smallest sum of channel magnitudes */
+UM_HOT void find_quietest_frame(const int16_t *x, uint32_t first, uint32_t last, uint32_t channels,
+                                uint32_t *min_level, uint32_t *quietest)
 {
-    uint8_t i = 0;
+    uint32_t i, ch;
 
-    UM_RET_IF_FALSE(handle != NULL, UM_EARGS);
+    for(i = first; i < last; i++, x += channels)
+    {
+        uint32_t level = 0;
 
-    UM_RET_IF_FALSE(
-        GET_CONFIG_CA_ALGORITM(config) == UM_BUFFER_CONFIG_CA_NONE ||
-        GET_CONFIG_CA_ALGORITM(config) == UM_BUFFER_CONFIG_CA_DROP_HALF_PKT ||
-        GET_CONFIG_CA_ALGORITM(config) == UM_BUFFER_CONFIG_CA_FEEDBACK, UM_EARGS);
+        for(ch = 0; ch < channels; ch++)
+        {
+            int32_t value = x[ch];
+            level += (uint32_t)(value < 0 ? -value : value);
+        }
 
-    handle->um_usb_packet_size = usb_packet_size;
-    handle->um_usb_frame_in_node = usb_frame_in_um_node_count;
-    handle->um_number_of_nodes = um_node_count;
+        if(level < *min_level)
+        {
+            *min_level = level;
+            *quietest = i;
+        }
+    }
+}
 
-    // allocate memory for whole internal buffer; store pointer to it here temporary
-    if(GET_CONFIG_CA_ALGORITM(config) != UM_BUFFER_CONFIG_CA_NONE)
+/* Removes (fill above target) or duplicates (below target) one frame at the quietest point of the packet.
+ * Packet is 16 bit PCM at ring offset "start" and may wrap; there is room for one more frame after it.
+ * It is scanned and moved as at most two contiguous spans: before the end of the ring and from its beginning */
+UM_HOT uint32_t stretch_squeeze_packet(struct um_buffer_handle *handle, uint32_t start, uint32_t pkt_size, const struct um_geometry g)
+{
+    uint32_t sample_size = g.sample_size;
+    uint32_t samples = pkt_size / sample_size;
+    uint8_t *ring = handle->um_buffer;
+    uint8_t *ring_end = ring + handle->total_buffer_size;
+    /* frames are whole (see check_config), so the end of the ring is between frames "head - 1" and "head";
+     * USB position is always before the end, so there is at least one frame before it */
+    uint32_t head = (handle->total_buffer_size - start) / sample_size;
+    uint32_t quietest = 1, min_level = UINT32_MAX;
+    uint8_t *frame;
+
+    if(!GET_CONGESTION_AVOIDANCE_FLAG(handle->um_buffer_flags) || samples < 3)
+        return pkt_size;
+
+    /* first and last frames are kept, so the packet joins its neighbours as it was */
+    find_quietest_frame((const int16_t *)(ring + start + sample_size), 1, head < samples - 1 ? head : samples - 1,
+                        sample_size >> 1, &min_level, &quietest);
+    if(head < samples - 1)
+        find_quietest_frame((const int16_t *)ring, head, samples - 1, sample_size >> 1, &min_level, &quietest);
+
+    frame = quietest < head ? ring + start + (quietest * sample_size) : ring + ((quietest - head) * sample_size);
+
+    if(handle->um_fill_error > 0)
     {
-        handle->congestion_avoidance_bucket = (uint8_t *)malloc((usb_packet_size * usb_frame_in_um_node_count * um_node_count) + usb_packet_size);
+        /* squeeze: frames after the quietest one are moved one frame back */
+        if(quietest >= head || samples - 1 < head)
+        {
+            memmove(frame, frame + sample_size, (samples - 1 - quietest) * sample_size);
+        }
+        else
+        {
+            memmove(frame, frame + sample_size, (head - 1 - quietest) * sample_size);
+            memcpy(ring_end - sample_size, ring, sample_size);
+            memmove(ring, ring + sample_size, (samples - 1 - head) * sample_size);
+        }
+        return pkt_size - sample_size;
     }
     else
     {
-        handle->congestion_avoidance_bucket = (uint8_t *)malloc((usb_packet_size * usb_frame_in_um_node_count * um_node_count));
+        /* stretch: quietest frame and the ones after it are moved one frame forward */
+        if(quietest >= head || samples < head)
+        {
+            memmove(frame + sample_size, frame, (samples - quietest) * sample_size);
+        }
+        else
+        {
+            memmove(ring + sample_size, ring, (samples - head) * sample_size);
+            memcpy(ring, ring_end - sample_size, sample_size);
+            memmove(frame + sample_size, frame, (head - 1 - quietest) * sample_size);
+        }
+        return pkt_size + sample_size;
     }
+}
 
-    UM_RET_IF_FALSE(handle->congestion_avoidance_bucket != NULL, UM_ENOMEM);
+/* Linear ramp over the node of 16 bit words: from silence to src content (fade in), or from src content to silence (fade out).
+ * Wider IN samples are ramped by halfwords as DMA writes them; error of the low halfword is below 16 bit resolution */
+static void conceal_ramp(struct um_buffer_handle *handle, int16_t *dst, const int16_t *src, uint8_t fade_in)
+{
+    uint32_t channels = handle->um_sample_size >> 1;
+    uint32_t frames = handle->um_node_size / handle->um_sample_size;
+    uint32_t i, ch;
+
+    for(i = 0; i < frames; i++)
+    {
+        int32_t gain = (int32_t)(((fade_in ? i : frames - i) << 15) / frames);
 
-    handle->cur_um_node_for_hw = *_alloc_um_nodes(handle, &(handle->start_um_node));
-    UM_RET_IF_FALSE(handle->cur_um_node_for_hw != NULL, UM_ENOMEM);
+        for(ch = 0; ch < channels; ch++, src++, dst++)
+        {
+            *dst = (int16_t)((*src * gain) >> 15);
+        }
+    }
+}
 
-    handle->cur_um_node_for_hw->next = handle->start_um_node;
-    handle->cur_um_node_for_hw = handle->start_um_node;
-    handle->cur_um_node_for_usb = handle->start_um_node;
+static void set_node_count(struct um_buffer_handle *handle, uint32_t node_count)
+{
+    handle->um_number_of_nodes = node_count;
+    handle->um_node_mask = node_count - 1;
 
-    /* main buffer pointer was copied inside start_um_node struct; allocate new memory for CA algorithm (if it is nessesary) */
-    if(GET_CONFIG_CA_ALGORITM(config) != UM_BUFFER_CONFIG_CA_NONE)
+    /* bucket is right after the last node in use; nodes are contiguous, so packet may overlap it */
+    if(GET_CONFIG_CA_ALGORITM(handle->um_buffer_config) != UM_BUFFER_CONFIG_CA_NONE)
     {
-        handle->congestion_avoidance_bucket += (usb_packet_size * usb_frame_in_um_node_count * um_node_count);
+        handle->congestion_avoidance_bucket = handle->um_buffer + (handle->um_node_size * node_count);
     }
     else
     {
         handle->congestion_avoidance_bucket = NULL;
     }
 
+    handle->total_buffer_size = handle->um_buffer_size_in_one_node * node_count;
+}
+
+/* Validates geometry and CA mode of the ring against memory block size */
+static int check_config(uint32_t mem_size,
+                        uint32_t usb_packet_size,
+                        uint32_t sample_size,
+                        uint32_t usb_frame_in_um_node_count,
+                        uint32_t um_node_count,
+                        uint8_t config)
+{
+    UM_RET_IF_FALSE(sample_size != 0, UM_EARGS);
+
+    UM_RET_IF_FALSE(
+        GET_CONFIG_CA_ALGORITM(config) == UM_BUFFER_CONFIG_CA_NONE ||
+        GET_CONFIG_CA_ALGORITM(config) == UM_BUFFER_CONFIG_CA_STRETCH ||
+        GET_CONFIG_CA_ALGORITM(config) == UM_BUFFER_CONFIG_CA_FEEDBACK ||
+        GET_CONFIG_CA_ALGORITM(config) == UM_BUFFER_CONFIG_CA_ASRC, UM_EARGS);
+
+    /* stretch works with 16 bit samples; whole frames, so no frame is split by the end of the ring */
+    UM_RET_IF_FALSE(
+        GET_CONFIG_CA_ALGORITM(config) != UM_BUFFER_CONFIG_CA_STRETCH ||
+        ((sample_size & 1) == 0 && (usb_packet_size % sample_size) == 0), UM_EARGS);
+
+    /* resampler works with 16 bit samples; packet and its history should fit into the bucket */
+    UM_RET_IF_FALSE(
+        GET_CONFIG_CA_ALGORITM(config) != UM_BUFFER_CONFIG_CA_ASRC ||
+        ((sample_size & 1) == 0 && (sample_size >> 1) <= UM_ASRC_MAX_CHANNELS &&
+         UM_ASRC_HISTORY_SIZE(sample_size) + usb_packet_size + sample_size <= UM_CA_BUCKET_SIZE(usb_packet_size)), UM_EARGS);
+
+    /* dequeue path always counts bytes; IN feedback is asynchronous packet sizing */
+    UM_RET_IF_FALSE(
+        GET_CONFIG_DIR(config) == UM_BUFFER_CONFIG_DIR_OUT ||
+        GET_CONFIG_CA_ALGORITM(config) == UM_BUFFER_CONFIG_CA_NONE ||
+        GET_CONFIG_CA_ALGORITM(config) == UM_BUFFER_CONFIG_CA_FEEDBACK, UM_EARGS);
+
+    /* node indexes are wrapped with mask, so count of nodes should be power of two;
+     * not less than um_handle_set_target_latency uses, so any ring, which is accepted here, can be set up by it */
+    UM_RET_IF_FALSE(um_node_count >= UM_MIN_NODE_COUNT && (um_node_count & (um_node_count - 1)) == 0, UM_EARGS);
+    UM_RET_IF_FALSE(mem_size >= UM_BUFFER_MEM_SIZE(usb_packet_size, usb_frame_in_um_node_count, um_node_count), UM_ENOMEM);
+
+    return UM_EOK;
+}
+
+/* Lays the ring out in memory block; hardware should be stopped */
+static void set_geometry(struct um_buffer_handle *handle,
+                         uint8_t *mem,
+                         uint32_t usb_packet_size,
+                         uint32_t sample_size,
+                         uint32_t usb_frame_in_um_node_count,
+                         uint32_t um_node_count,
+                         uint8_t config)
+{
+    uint16_t i = 0;
+    uint32_t node_size = usb_packet_size * usb_frame_in_um_node_count;
+
+    handle->um_usb_packet_size = usb_packet_size;
+    handle->um_sample_size = sample_size;
+    handle->um_node_size = node_size;
+    handle->um_usb_frame_in_node = usb_frame_in_um_node_count;
+    handle->um_node_capacity = um_node_count;
+
+    /* memory layout: [ audio data of all nodes | CA bucket | conceal node | node descriptors ] */
+    handle->um_buffer = mem;
+    handle->um_conceal_node = mem + (node_size * um_node_count) + UM_CA_BUCKET_SIZE(usb_packet_size);
+    handle->um_nodes = (struct um_node *)(mem + UM_ALIGN4((node_size * (um_node_count + 1)) + UM_CA_BUCKET_SIZE(usb_packet_size)));
+
+    for(i = 0; i < um_node_count; i++)
+    {
+        handle->um_nodes[i].um_buf = handle->um_buffer + (node_size * i);
+    }
+
     handle->um_buffer_state = UM_BUFFER_STATE_INIT;
-    handle->um_abs_offset = 0;
-    handle->um_buffer_flags = 0;
     handle->um_buffer_config = config;
 
+    /* packet size is fixed only without CA, otherwise offsets are counted in bytes */
     handle->um_buffer_size_in_one_node =
-        GET_CONFIG_CA_ALGORITM(config) == UM_BUFFER_CONFIG_CA_FEEDBACK ?
-        handle->um_usb_frame_in_node * handle->um_usb_packet_size :
+        GET_CONFIG_CA_ALGORITM(config) != UM_BUFFER_CONFIG_CA_NONE ?
+        node_size :
         handle->um_usb_frame_in_node;
-    handle->total_buffer_size = handle->um_buffer_size_in_one_node * handle->um_number_of_nodes;
+
+    /* whole memory is in use and hardware starts when it is half full, until target latency is set */
+    set_node_count(handle, um_node_count);
+    handle->um_target_fill = (node_size * um_node_count) >> 1;
+
+    handle->cur_um_node_for_hw = 0;
+    reset_usb_position(handle, 0);
+
+    memset(handle->um_conceal_node, 0, node_size);
+    handle->um_conceal_state = 0;
+    handle->um_standby = 0;
+    handle->um_settle_fill = 0;
+
+    if(GET_CONFIG_CA_ALGORITM(config) == UM_BUFFER_CONFIG_CA_ASRC)
+    {
+        um_asrc_init(&handle->asrc, sample_size >> 1, (int16_t *)handle->congestion_avoidance_bucket);
+    }
+}
+
+int um_handle_init( struct um_buffer_handle *handle,
+                    uint8_t *mem, uint32_t mem_size,
+                    uint32_t usb_packet_size,
+                    uint32_t sample_size,
+                    uint32_t usb_frame_in_um_node_count,
+                    uint32_t um_node_count,
+                    uint8_t config,
+                    um_play_fnc play, um_pause_resume_fnc pause_resume,
+                    um_next_node_fnc next_node )
+{
+    uint16_t i = 0;
+    int result;
+
+    UM_RET_IF_FALSE(handle != NULL, UM_EARGS);
+    UM_RET_IF_FALSE(mem != NULL, UM_EARGS);
+    UM_RET_IF_FALSE(play != NULL && pause_resume != NULL && next_node != NULL, UM_EARGS);
+
+    result = check_config(mem_size, usb_packet_size, sample_size, usb_frame_in_um_node_count, um_node_count, config);
+    UM_RET_IF_FALSE(result == UM_EOK, result);
+
+    set_geometry(handle, mem, usb_packet_size, sample_size, usb_frame_in_um_node_count, um_node_count, config);
+    handle->um_mem_size = mem_size;
+    handle->um_underruns = 0;
 
     handle->um_play = play;
     handle->um_pause_resume = pause_resume;
+    handle->um_next_node = next_node;
+    handle->um_hw_position = NULL;
 
     for(i = 0; i < UM_LISTENER_TYPE_COUNT; i++)
         handle->listeners[i] = NULL;
+    handle->um_packet_count = 0;
 
     return UM_EOK;
 }
 
-uint8_t *um_handle_enqueue(struct um_buffer_handle *handle, uint16_t pkt_size)
+uint32_t um_handle_reserve(struct um_buffer_handle *handle, uint32_t max_bytes, struct um_span span[2])
 {
-    uint8_t cw;
-    uint8_t *result = NULL;
-    
-    struct um_buffer_listener *ca_listener = handle->listeners[UM_LISTENER_TYPE_CA];
-    uint32_t free_buffer_size = 0;
+    struct um_geometry g;
+    uint32_t extra = 0;
+
+    UM_RET_IF_FALSE(handle != NULL && span != NULL, 0);
+    UM_RET_IF_FALSE(GET_CONFIG_DIR(handle->um_buffer_config) == UM_BUFFER_CONFIG_DIR_OUT, 0);
 
-    switch(GET_CONFIG_CA_ALGORITM(handle->um_buffer_config))
+    g = UM_HANDLE_GEOMETRY(handle);
+
+    switch(g.ca)
     {
         case UM_BUFFER_CONFIG_CA_NONE:
-            if(handle->cur_um_node_for_usb->um_node_offset == 0)
-            {
-                /* Check for buffer overflow */
-                UM_VERIFY((handle->cur_um_node_for_usb->um_node_state == UM_NODE_STATE_HW_FINISHED) || (handle->cur_um_node_for_usb->um_node_state == UM_NODE_STATE_INITIAL));
+            /* packets are of fixed size and never cross the end of the ring; overflow is checked on commit */
+            UM_RET_IF_FALSE(max_bytes <= handle->um_usb_packet_size, 0);
+        break;
 
-                handle->cur_um_node_for_usb->um_node_state = UM_NODE_STATE_UNDER_USB;
-            }
+        case UM_BUFFER_CONFIG_CA_ASRC:
+            /* packet goes to resampler input, which is always available */
+            UM_RET_IF_FALSE(UM_ASRC_HISTORY_SIZE(handle->um_sample_size) + max_bytes <= UM_CA_BUCKET_SIZE(handle->um_usb_packet_size), 0);
+        break;
 
-            handle->um_abs_offset = (handle->um_abs_offset + 1) % handle->total_buffer_size;
+        case UM_BUFFER_CONFIG_CA_STRETCH:
+            /* stretched packet is one sample longer */
+            extra = handle->um_sample_size;
+            /* fall through */
 
-            if(++(handle->cur_um_node_for_usb->um_node_offset) == handle->um_usb_frame_in_node)
-            {
-                handle->cur_um_node_for_usb->um_node_offset = 0;
-                handle->cur_um_node_for_usb->um_node_state = UM_NODE_STATE_USB_FINISHED;
-                handle->cur_um_node_for_usb = handle->cur_um_node_for_usb->next;
-            }
-            result = handle->cur_um_node_for_usb->um_buf + (handle->cur_um_node_for_usb->um_node_offset * handle->um_usb_packet_size);
-        break;/* UM_BUFFER_CONFIG_CA_NONE */
+        case UM_BUFFER_CONFIG_CA_FEEDBACK:
+            UM_RET_IF_FALSE(um_usb_has_room(handle, max_bytes + extra, g), 0);
 
-        case UM_BUFFER_CONFIG_CA_DROP_HALF_PKT:
-            if((handle->cur_um_node_for_usb->um_node_offset == 0) && !GET_HALF_USB_FRAME_FLAG(handle->um_buffer_flags))
+            if(handle->um_abs_offset + max_bytes > handle->total_buffer_size)
             {
-                /* Check for buffer overflow */
-                UM_VERIFY((handle->cur_um_node_for_usb->um_node_state == UM_NODE_STATE_HW_FINISHED) || (handle->cur_um_node_for_usb->um_node_state == UM_NODE_STATE_INITIAL));
-    
-                handle->cur_um_node_for_usb->um_node_state = UM_NODE_STATE_UNDER_USB;
+                span[0].ptr = handle->um_buffer + handle->um_abs_offset;
+                span[0].size = handle->total_buffer_size - handle->um_abs_offset;
+                span[1].ptr = handle->um_buffer;
+                span[1].size = max_bytes - span[0].size;
+                return 2;
             }
+        break;
 
-            if(!GET_CONGESTION_AVOIDANCE_FLAG(handle->um_buffer_flags))
-            {
-                handle->um_abs_offset = (handle->um_abs_offset + 1) % handle->total_buffer_size;
-
-                if(++(handle->cur_um_node_for_usb->um_node_offset) == handle->um_usb_frame_in_node)
-                {
-                    handle->cur_um_node_for_usb->um_node_offset = 0;
-                    handle->cur_um_node_for_usb->um_node_state = UM_NODE_STATE_USB_FINISHED;
-                    handle->cur_um_node_for_usb = handle->cur_um_node_for_usb->next;
-                }
-                result = handle->cur_um_node_for_usb->um_buf + (handle->cur_um_node_for_usb->um_node_offset * handle->um_usb_packet_size);
-            }
-            else /* CONGESTION AVOIDANCE in progress... */
-            {
-                uint8_t i = 0, j = 0;
-
-                for(i = 0; i < handle->um_usb_packet_size; i+=8)
-                {
-                    memcpy(handle->start_um_node->um_buf + (handle->um_abs_offset * handle->um_usb_packet_size) + ((handle->um_usb_packet_size >> 1) * GET_HALF_USB_FRAME_FLAG(handle->um_buffer_flags)) + j, handle->congestion_avoidance_bucket + i, 4);
-                    j+=4;
-                }
+        default:
+            /* failed args validation during buffer initialisation */
+            UM_VERIFY(0);
+    }
 
-                if(GET_HALF_USB_FRAME_FLAG(handle->um_buffer_flags))
-                {
-                    handle->um_abs_offset = (handle->um_abs_offset + 1) % handle->total_buffer_size;
-
-                    if(++(handle->cur_um_node_for_usb->um_node_offset) == handle->um_usb_frame_in_node)
-                    {
-                        handle->cur_um_node_for_usb->um_node_offset = 0;
-                        handle->cur_um_node_for_usb->um_node_state = UM_NODE_STATE_USB_FINISHED;
-                        handle->cur_um_node_for_usb = handle->cur_um_node_for_usb->next;
-                    }
-                }
+    span[0].ptr = usb_write_ptr(handle, g);
+    span[0].size = max_bytes;
+    return 1;
+}
 
-                TOGGLE_HALF_USB_FRAME_FLAG(handle->um_buffer_flags);
-                result = handle->congestion_avoidance_bucket;
-            }
+/* Body of um_handle_commit; it is inlined into generic API and into fast path of each of UM_STREAMS */
+UM_HOT int commit_packet(struct um_buffer_handle *handle, uint32_t bytes, const struct um_geometry g)
+{
+    switch(g.ca)
+    {
+        case UM_BUFFER_CONFIG_CA_NONE:
+            handle->um_usb_bytes += g.packet_size;
 
-            cw = get_congestion_window(handle->cur_um_node_for_usb->next);
+            if(++(handle->um_abs_offset) == handle->total_buffer_size)
+                handle->um_abs_offset = 0;
 
-            if(GET_CONGESTION_AVOIDANCE_FLAG(handle->um_buffer_flags))
+            if((handle->um_usb_node_offset + 1) == handle->um_usb_frame_in_node)
             {
-                if((cw == CW_UPPER_BOUND) && !GET_HALF_USB_FRAME_FLAG(handle->um_buffer_flags))
+                /* Check for buffer overflow */
+                if(!um_usb_node_can_advance(handle, 1, g))
                 {
-                    TOGGLE_CONGESTION_AVOIDANCE_FLAG(handle->um_buffer_flags);
-                    result = handle->cur_um_node_for_usb->um_buf + (handle->cur_um_node_for_usb->um_node_offset * handle->um_usb_packet_size);
+                    handle->um_usb_bytes -= g.packet_size;
+                    handle->um_abs_offset = handle->um_abs_offset == 0 ? handle->total_buffer_size - 1 : handle->um_abs_offset - 1;
+                    return UM_EBUFOVERFLOW;
                 }
+
+                handle->um_usb_node_offset = 0;
+                um_usb_node_finished(handle, 1);
             }
             else
             {
-                if(cw == CW_LOWER_BOUND)
-                {
-                    TOGGLE_CONGESTION_AVOIDANCE_FLAG(handle->um_buffer_flags);
-                    result = handle->congestion_avoidance_bucket;
-                }
+                handle->um_usb_node_offset++;
             }
-        break; /* UM_BUFFER_CONFIG_CA_DROP_HALF_PKT */
+        break;/* UM_BUFFER_CONFIG_CA_NONE */
+
+        case UM_BUFFER_CONFIG_CA_STRETCH:
+            UM_RET_IF_FALSE(um_usb_has_room(handle, bytes + g.sample_size, g), UM_EBUFOVERFLOW);
+
+            /* size of the packet is changed, the rest is the same as with feedback */
+            bytes = stretch_squeeze_packet(handle, handle->um_abs_offset, bytes, g);
+            /* fall through */
 
         case UM_BUFFER_CONFIG_CA_FEEDBACK:
-            handle->cur_um_node_for_usb->um_node_offset += pkt_size;
-            handle->um_abs_offset += pkt_size;
+            /* buffer overflow; packet is dropped */
+            UM_RET_IF_FALSE(um_usb_has_room(handle, bytes, g), UM_EBUFOVERFLOW);
 
-            if(handle->cur_um_node_for_usb->um_node_offset >= handle->um_buffer_size_in_one_node)
-            {
-                if(handle->cur_um_node_for_usb->next->um_node_state != UM_NODE_STATE_HW_FINISHED
-                && handle->cur_um_node_for_usb->next->um_node_state != UM_NODE_STATE_INITIAL)
-                {
-                    /* buffer overflow; shouldn`t be here.... */
-                    /* reset offsets; in case of user deside to drop this packet */
-                    handle->cur_um_node_for_usb->um_node_offset -= pkt_size;
-                    handle->um_abs_offset -= pkt_size;
-                    UM_RET_IF_FALSE(0, result);
-                }
-                handle->cur_um_node_for_usb->next->um_node_offset = handle->cur_um_node_for_usb->um_node_offset % handle->um_buffer_size_in_one_node;
-                handle->cur_um_node_for_usb->um_node_offset = 0;
-                handle->cur_um_node_for_usb->um_node_state = UM_NODE_STATE_USB_FINISHED;
-                handle->cur_um_node_for_usb = handle->cur_um_node_for_usb->next;
-                handle->cur_um_node_for_usb->um_node_state = UM_NODE_STATE_UNDER_USB;
-            }
+            um_usb_advance_bytes(handle, bytes, g);
+        break; /* UM_BUFFER_CONFIG_CA_FEEDBACK */
 
-            if(handle->um_abs_offset > handle->total_buffer_size)
-            {
-                memcpy(handle->cur_um_node_for_usb->um_buf, handle->congestion_avoidance_bucket, handle->um_abs_offset - handle->total_buffer_size);
-            }
+        case UM_BUFFER_CONFIG_CA_ASRC:
+        {
+            uint32_t in_samples = bytes / g.sample_size;
 
-            handle->um_abs_offset %= handle->total_buffer_size;
+            /* resampler gives at most one sample more than it gets; packet is dropped on overflow */
+            UM_RET_IF_FALSE(um_usb_has_room(handle, (in_samples + 1) * g.sample_size, g), UM_EBUFOVERFLOW);
 
-            result = handle->cur_um_node_for_usb->um_buf + handle->cur_um_node_for_usb->um_node_offset;
+            um_usb_advance_bytes(handle, g.sample_size * um_asrc_process(&handle->asrc,
+                (int16_t *)handle->congestion_avoidance_bucket, in_samples,
+                handle->um_buffer, handle->um_abs_offset, handle->total_buffer_size), g);
+        }
+        break; /* UM_BUFFER_CONFIG_CA_ASRC */
 
-        break; /* UM_BUFFER_CONFIG_CA_FEEDBACK */
         default:
             /* failed args validation during buffer initialisation */
             /* should not be here.... */
             UM_VERIFY(0);
-
     }
 
-    if(handle->um_buffer_state != UM_BUFFER_STATE_PLAY)
+    if(handle->um_standby)
+    {
+        /* hardware plays conceal node, until stream is primed again; it takes one or two more nodes
+         * to get to the ring from conceal node, so priming is finished one node earlier */
+        if(get_fill_bytes(handle, g) + g.node_size < handle->um_target_fill)
+            return UM_EOK;
+
+        reset_watermarks(handle);
+        handle->um_standby = 0;
+    }
+    else if(handle->um_buffer_state != UM_BUFFER_STATE_PLAY)
     {
-        if(handle->um_abs_offset >= (handle->total_buffer_size >> 1))
+        if(get_fill_bytes(handle, g) >= handle->um_target_fill)
         {
-            handle->start_um_node->um_node_state = UM_NODE_STATE_UNDER_HW;
-            if(handle->um_buffer_state == UM_BUFFER_STATE_INIT)
-            {
-                handle->um_play((uint32_t)handle->start_um_node->um_buf, (handle->um_usb_frame_in_node * handle->um_number_of_nodes * handle->um_usb_packet_size) >> 1);
-            }
-            else /* UM_BUFFER_STATE_READY */
-            {
-                handle->um_pause_resume(1, (uint32_t)handle->start_um_node->um_buf, (handle->um_usb_frame_in_node * handle->um_number_of_nodes * handle->um_usb_packet_size) >> 1);
-            }
+            reset_watermarks(handle);
+            handle->um_conceal_state = 0;
+
+            /* hand HW node index over to interrupt context before hardware is started */
+            UM_DMB();
             handle->um_buffer_state = UM_BUFFER_STATE_PLAY;
+
+            /* OUT hardware is only stopped by stop_hw, so it always starts from a ring node;
+             * DMA takes first two nodes, following ones are passed to it from interrupt one by one */
+            handle->um_play(UM_ADDR(UM_CUR_NODE_FOR_HW(handle)->um_buf), g.node_size);
         }
         else
         {
             /* no need to notify listeners until buffer is not in PLAY state */
-            return result;
+            return UM_EOK;
         }
     }
 
-    while(ca_listener != NULL)
+    if(g.ca == UM_BUFFER_CONFIG_CA_STRETCH)
     {
-        free_buffer_size = free_buffer_size == 0 ? get_free_buffer_persentage(handle) : free_buffer_size;
-        ca_listener->listener_handle((void *)&free_buffer_size);
-        ca_listener = ca_listener->next;
+        update_stretch_squeeze(handle, g);
     }
-   
-    return result;
+    else if(g.ca == UM_BUFFER_CONFIG_CA_ASRC)
+    {
+        /* steer resampler to keep fill level at target */
+        um_asrc_update(&handle->asrc, ((int32_t)get_fill_bytes(handle, g) - (int32_t)handle->um_target_fill) / (int32_t)g.sample_size);
+    }
+
+    notify_listeners(handle, g);
+
+    return UM_EOK;
 }
 
-uint8_t *um_handle_dequeue(struct um_buffer_handle *handle, uint16_t pkt_size)
+int um_handle_commit(struct um_buffer_handle *handle, uint32_t bytes)
+{
+    UM_RET_IF_FALSE(handle != NULL, UM_EARGS);
+    UM_RET_IF_FALSE(GET_CONFIG_DIR(handle->um_buffer_config) == UM_BUFFER_CONFIG_DIR_OUT, UM_EARGS);
+
+    return commit_packet(handle, bytes, UM_HANDLE_GEOMETRY(handle));
+}
+
+uint32_t um_handle_get_rx_window(struct um_buffer_handle *handle, uint32_t *offset)
+{
+    uint8_t ca;
+    uint32_t window;
+
+    UM_RET_IF_FALSE(handle != NULL && offset != NULL, 0);
+    UM_RET_IF_FALSE(GET_CONFIG_DIR(handle->um_buffer_config) == UM_BUFFER_CONFIG_DIR_OUT, 0);
+
+    ca = GET_CONFIG_CA_ALGORITM(handle->um_buffer_config);
+    UM_RET_IF_FALSE(ca == UM_BUFFER_CONFIG_CA_FEEDBACK || ca == UM_BUFFER_CONFIG_CA_STRETCH, 0);
+
+    /* write may reach the last byte before the node under hardware (see um_usb_has_room) */
+    window = (handle->um_number_of_nodes - (handle->cur_um_node_for_usb - um_hw_node(handle))) * handle->um_node_size
+             - handle->um_usb_node_offset - 1;
+
+    /* stretched packet is one sample longer */
+    if(ca == UM_BUFFER_CONFIG_CA_STRETCH)
+        window = window > handle->um_sample_size ? window - handle->um_sample_size : 0;
+
+    *offset = handle->um_abs_offset;
+    return window;
+}
+
+uint8_t *um_handle_enqueue(struct um_buffer_handle *handle, uint16_t pkt_size)
+{
+    const struct um_geometry g = UM_HANDLE_GEOMETRY(handle);
+    uint8_t ca = g.ca;
+    int result;
+
+    /* packet has been received contiguously at USB position; the part behind the end of the ring is in the bucket */
+    if((ca == UM_BUFFER_CONFIG_CA_FEEDBACK || ca == UM_BUFFER_CONFIG_CA_STRETCH) &&
+       handle->um_abs_offset + pkt_size > handle->total_buffer_size)
+    {
+        UM_RET_IF_FALSE(um_usb_has_room(handle, pkt_size + (ca == UM_BUFFER_CONFIG_CA_STRETCH ? g.sample_size : 0), g), NULL);
+
+        memcpy(handle->um_buffer, handle->congestion_avoidance_bucket, handle->um_abs_offset + pkt_size - handle->total_buffer_size);
+    }
+
+    result = commit_packet(handle, pkt_size, g);
+
+    /* without CA host never sends more than hardware plays; overflow is fatal */
+    if(ca == UM_BUFFER_CONFIG_CA_NONE)
+        UM_VERIFY(result == UM_EOK);
+
+    UM_RET_IF_FALSE(result == UM_EOK, NULL);
+
+    return usb_write_ptr(handle, g);
+}
+
+/* IN: USB position is moved to the target latency behind hardware; node under hardware is not counted */
+static void in_stream_follow_hw(struct um_buffer_handle *handle)
+{
+    uint32_t hw_node = um_hw_node(handle);
+    uint32_t target_nodes = (handle->um_target_fill + handle->um_node_size - 1) / handle->um_node_size;
+
+    if((int32_t)(hw_node - target_nodes) > 0)
+        reset_usb_position(handle, hw_node - target_nodes);
+}
+
+/* IN: the first node of the stream fades in from silence, so there is no step at the beginning of recording */
+static void in_stream_start(struct um_buffer_handle *handle)
+{
+    int16_t *node;
+
+    in_stream_follow_hw(handle);
+    handle->um_buffer_flags &= ~UM_BUFFER_FLAG_PREROLL;
+
+    node = (int16_t *)UM_CUR_NODE_FOR_USB(handle)->um_buf;
+    conceal_ramp(handle, node, node, 1);
+}
+
+/* IN: hardware is stopped, so both indexes belong to this context; capture starts from the first node
+ * and USB side sends silence, until it has dropped settle time and filled target latency */
+static void in_start_hw(struct um_buffer_handle *handle, uint32_t node_size)
+{
+    handle->cur_um_node_for_hw = 0;
+    reset_usb_position(handle, 0);
+    handle->um_buffer_flags |= UM_BUFFER_FLAG_PREROLL;
+    reset_watermarks(handle);
+
+    UM_DMB();
+    handle->um_buffer_state = UM_BUFFER_STATE_PLAY;
+
+    handle->um_play(UM_ADDR(handle->um_buffer), node_size);
+}
+
+/* CA_FEEDBACK of IN stream (asynchronous endpoint): packet is one frame longer or shorter than nominal,
+ * while filtered fill error is beyond the deadband, so fill level follows target with any capture clock */
+UM_HOT uint32_t in_async_packet_size(struct um_buffer_handle *handle, const struct um_geometry g)
+{
+    int32_t error = ((int32_t)get_fill_bytes(handle, g) - (int32_t)handle->um_target_fill) / (int32_t)g.sample_size;
+
+    handle->um_fill_error += ((error * (1 << UM_STRETCH_ERROR_FRAC_BITS)) - handle->um_fill_error) >> UM_STRETCH_FILTER_SHIFT;
+
+    if(handle->um_fill_error >= (UM_ASYNC_IN_DEADBAND << UM_STRETCH_ERROR_FRAC_BITS))
+        return g.packet_size + g.sample_size;
+
+    if(handle->um_fill_error <= -(UM_ASYNC_IN_DEADBAND << UM_STRETCH_ERROR_FRAC_BITS))
+        return g.packet_size - g.sample_size;
+
+    return g.packet_size;
+}
+
+/* Body of um_handle_read/um_handle_dequeue; it is inlined like commit_packet */
+UM_HOT uint32_t in_read(struct um_buffer_handle *handle, uint32_t pkt_size, struct um_span span[2], const struct um_geometry g)
 {
-    uint8_t *result = NULL;
-    struct um_buffer_listener *ca_listener = handle->listeners[UM_LISTENER_TYPE_CA];
-    uint32_t free_buffer_size = 0;
+    uint32_t node_size = g.node_size;
 
     if(handle->um_buffer_state != UM_BUFFER_STATE_PLAY)
     {
-        struct um_node *threshold = handle->start_um_node->next->next;
+        in_start_hw(handle, node_size);
+
+        span[0].ptr = handle->um_conceal_node;
+        span[0].size = pkt_size;
+        return 1;
+    }
+
+    if(handle->um_standby)
+    {
+        /* hardware has been capturing all the time; stream continues with the latest target latency of audio */
+        if(!GET_PREROLL_FLAG(handle->um_buffer_flags))
+            in_stream_start(handle);
+
+        /* USB position should be visible for interrupt before overflow check is enabled again */
+        UM_DMB();
+        handle->um_standby = 0;
+    }
 
-        switch (threshold->um_node_state)
+    if(GET_PREROLL_FLAG(handle->um_buffer_flags))
+    {
+        /* zeros are sent, until hardware has dropped settle time and filled target latency;
+         * USB position follows hardware meanwhile, so settle time may be longer than the ring */
+        if((um_hw_node(handle) * node_size) < handle->um_target_fill + handle->um_settle_fill)
         {
-        case UM_NODE_STATE_INITIAL:
-            threshold->um_node_state = UM_NODE_STATE_USB_FINISHED;
-            handle->um_play((uint32_t)handle->start_um_node->um_buf, (handle->um_number_of_nodes * handle->um_usb_frame_in_node * handle->um_usb_packet_size) >> 1);
-            return threshold->next->um_buf;
+            in_stream_follow_hw(handle);
+            handle->um_buffer_flags |= UM_BUFFER_FLAG_PREROLL;
 
-        case UM_NODE_STATE_UNDER_HW:
-            handle->um_buffer_state = UM_BUFFER_STATE_PLAY;
-            handle->cur_um_node_for_usb->um_node_state = UM_NODE_STATE_UNDER_USB;
-            handle->cur_um_node_for_usb->um_node_offset += pkt_size;
-            return handle->cur_um_node_for_usb->um_buf;
+            span[0].ptr = handle->um_conceal_node;
+            span[0].size = pkt_size;
+            return 1;
+        }
 
-        case UM_NODE_STATE_USB_FINISHED:
-            return threshold->next->um_buf;
+        in_stream_start(handle);
+    }
 
-        case UM_NODE_STATE_HW_FINISHED:
-        case UM_NODE_STATE_UNDER_USB:
-        default:
-            /* state machine error; shouldn`t be here... */
-            UM_VERIFY(0);
+    if(g.ca == UM_BUFFER_CONFIG_CA_NONE)
+    {
+        if(handle->um_usb_node_offset >= node_size)
+        {
+            /* check for buffer underflow */
+            UM_RET_IF_FALSE(um_usb_node_can_advance(handle, 1, g), 0);
+
+            handle->um_usb_node_offset -= node_size;
+            um_usb_node_finished(handle, 1);
         }
+
+        span[0].ptr = UM_CUR_NODE_FOR_USB(handle)->um_buf + handle->um_usb_node_offset;
+        span[0].size = pkt_size;
+
+        handle->um_usb_node_offset += pkt_size;
+        handle->um_usb_bytes += pkt_size;
+
+        notify_listeners(handle, g);
+        return 1;
     }
 
-    UM_VERIFY(handle->cur_um_node_for_usb->um_node_state == UM_NODE_STATE_UNDER_USB);
+    /* CA_FEEDBACK: packet may cross node boundary and the end of the ring; all of it should be captured already */
+    pkt_size = in_async_packet_size(handle, g);
+    UM_RET_IF_FALSE(get_fill_bytes(handle, g) >= pkt_size, 0);
+
+    span[0].ptr = handle->um_buffer + handle->um_abs_offset;
+    span[0].size = pkt_size;
 
-    if(handle->cur_um_node_for_usb->um_node_offset >= (handle->um_usb_frame_in_node * handle->um_usb_packet_size))
+    if(handle->um_abs_offset + pkt_size > handle->total_buffer_size)
     {
-        /* check for buffer underflow */
-        UM_RET_IF_FALSE(handle->cur_um_node_for_usb->next->um_node_state == UM_NODE_STATE_HW_FINISHED, result);
+        span[0].size = handle->total_buffer_size - handle->um_abs_offset;
+        span[1].ptr = handle->um_buffer;
+        span[1].size = pkt_size - span[0].size;
+    }
 
-        handle->cur_um_node_for_usb->next->um_node_offset = handle->cur_um_node_for_usb->um_node_offset % (handle->um_usb_frame_in_node * handle->um_usb_packet_size);
-        handle->cur_um_node_for_usb->um_node_offset = 0;
-        handle->cur_um_node_for_usb->um_node_state = UM_NODE_STATE_USB_FINISHED;
+    um_usb_advance_bytes(handle, pkt_size, g);
 
-        handle->cur_um_node_for_usb = handle->cur_um_node_for_usb->next;
-        handle->cur_um_node_for_usb->um_node_state = UM_NODE_STATE_UNDER_USB;
-    }
+    notify_listeners(handle, g);
+    return span[0].size == pkt_size ? 1 : 2;
+}
+
+uint8_t *um_handle_dequeue(struct um_buffer_handle *handle, uint16_t pkt_size)
+{
+    struct um_span span[2];
 
-    result = handle->cur_um_node_for_usb->um_buf + handle->cur_um_node_for_usb->um_node_offset;
+    /* packets of fixed size, which never cross the end of the ring */
+    UM_RET_IF_FALSE(GET_CONFIG_CA_ALGORITM(handle->um_buffer_config) == UM_BUFFER_CONFIG_CA_NONE, NULL);
 
-    handle->cur_um_node_for_usb->um_node_offset += pkt_size;
+    return in_read(handle, pkt_size, span, UM_HANDLE_GEOMETRY(handle)) ? span[0].ptr : NULL;
+}
 
-    while(ca_listener != NULL)
+uint32_t um_handle_read(struct um_buffer_handle *handle, struct um_span span[2])
+{
+    UM_RET_IF_FALSE(handle != NULL && span != NULL, 0);
+    UM_RET_IF_FALSE(GET_CONFIG_DIR(handle->um_buffer_config) == UM_BUFFER_CONFIG_DIR_IN, 0);
+
+    return in_read(handle, handle->um_usb_packet_size, span, UM_HANDLE_GEOMETRY(handle));
+}
+
+int um_handle_start(struct um_buffer_handle *handle)
+{
+    UM_RET_IF_FALSE(handle != NULL, UM_EARGS);
+    UM_RET_IF_FALSE(handle->um_buffer != NULL, UM_ESATE);
+    UM_RET_IF_FALSE(GET_CONFIG_DIR(handle->um_buffer_config) == UM_BUFFER_CONFIG_DIR_IN, UM_EARGS);
+
+    /* running or standby hardware goes on; the first read leaves standby */
+    if(handle->um_buffer_state != UM_BUFFER_STATE_PLAY)
+        in_start_hw(handle, handle->um_node_size);
+
+    return UM_EOK;
+}
+
+#ifdef UM_STREAMS
+#define UM_STREAM_GEOMETRY(ca_mode, dir, pkt_size, smp_size, frames) \
+    ((struct um_geometry){ (ca_mode), (dir), (pkt_size), (smp_size), (pkt_size) * (frames) })
+
+#define UM_STREAM_MATCHES(handle, g)                                                                  \
+    ((handle)->um_buffer_config == ((g).ca | (g).dir) && (handle)->um_usb_packet_size == (g).packet_size && \
+     (handle)->um_sample_size == (g).sample_size && (handle)->um_node_size == (g).node_size)
+
+#define UM_STREAM_OUT(name, ca_mode, pkt_size, smp_size, frames)                                      \
+int um_handle_commit_##name(struct um_buffer_handle *handle, uint32_t bytes)                          \
+{                                                                                                     \
+    const struct um_geometry g =                                                                      \
+        UM_STREAM_GEOMETRY(ca_mode, UM_BUFFER_CONFIG_DIR_OUT, pkt_size, smp_size, frames);            \
+                                                                                                      \
+    if(handle == NULL || !UM_STREAM_MATCHES(handle, g))                                               \
+        return um_handle_commit(handle, bytes);                                                       \
+                                                                                                      \
+    return commit_packet(handle, bytes, g);                                                           \
+}
+
+#define UM_STREAM_IN(name, ca_mode, pkt_size, smp_size, frames)                                       \
+uint32_t um_handle_read_##name(struct um_buffer_handle *handle, struct um_span span[2])               \
+{                                                                                                     \
+    const struct um_geometry g =                                                                      \
+        UM_STREAM_GEOMETRY(ca_mode, UM_BUFFER_CONFIG_DIR_IN, pkt_size, smp_size, frames);             \
+                                                                                                      \
+    if(handle == NULL || span == NULL || !UM_STREAM_MATCHES(handle, g))                               \
+        return um_handle_read(handle, span);                                                          \
+                                                                                                      \
+    return in_read(handle, g.packet_size, span, g);                                                   \
+}
+
+UM_STREAMS(UM_STREAM_OUT, UM_STREAM_IN)
+#endif
+
+/* Hardware is stopped and will be started from the first node again by the next enqueue/dequeue */
+static void stop_hw(struct um_buffer_handle *handle)
+{
+    if(handle->um_buffer_state == UM_BUFFER_STATE_PLAY)
     {
-        free_buffer_size = free_buffer_size == 0 ? get_free_buffer_persentage(handle) : free_buffer_size;
-        ca_listener->listener_handle((void *)&free_buffer_size);
-        ca_listener = ca_listener->next;
+        handle->um_pause_resume(0, UM_ADDR(handle->um_buffer), 0);
     }
 
-    return result;
+    /* take HW node index back */
+    handle->um_buffer_state = UM_BUFFER_STATE_INIT;
+    UM_DMB();
+    handle->um_standby = 0;
+    handle->um_conceal_state = 0;
 }
 
 void um_handle_pause(struct um_buffer_handle *handle)
 {
-    handle->um_pause_resume(0, (uint32_t)handle->start_um_node->um_buf, 0);
+    UM_RET_IF_FALSE(handle != NULL,);
+
+    /* DMA may be paused on conceal node or be pointed to it as the next memory, so it is not resumed where
+     * it has stopped; everything, which was not played, is dropped and hardware starts from the first node */
+    stop_hw(handle);
+
+    handle->cur_um_node_for_hw = 0;
+    reset_usb_position(handle, 0);
+
+    if(GET_CONFIG_CA_ALGORITM(handle->um_buffer_config) == UM_BUFFER_CONFIG_CA_ASRC)
+    {
+        um_asrc_restart(&handle->asrc, (int16_t *)handle->congestion_avoidance_bucket);
+    }
+}
+
+void um_handle_standby(struct um_buffer_handle *handle)
+{
+    UM_RET_IF_FALSE(handle != NULL,);
+
+    /* stopped hardware is started by the next enqueue/dequeue as usual */
+    if(handle->um_buffer_state != UM_BUFFER_STATE_PLAY)
+        return;
 
-    reset_nodes_states_to_default(handle);
+    handle->um_standby = 1;
+}
+
+int um_handle_set_target_latency(struct um_buffer_handle *handle, uint32_t latency_us)
+{
+    uint32_t target, nodes, rx_nodes, node_count;
+    uint8_t ca;
+
+    UM_RET_IF_FALSE(handle != NULL, UM_EARGS);
+    UM_RET_IF_FALSE(handle->um_buffer != NULL, UM_ESATE);
+
+    /* USB full speed packet carries 1 ms of audio; keep whole samples */
+    target = (latency_us * handle->um_usb_packet_size) / 1000;
+    target -= target % handle->um_sample_size;
+    UM_RET_IF_FALSE(target != 0, UM_EARGS);
+
+    /* ring is at least twice as long as target, so there is the same room for jitter in both directions;
+     * and not shorter than check_config allows */
+    nodes = ((target + handle->um_node_size - 1) / handle->um_node_size) << 1;
+
+    /* receiver of um_handle_get_rx_window is armed for the next packet, while this one is passed: besides target fill
+     * and node under hardware, ring holds two of the largest packets (one frame above um_usb_packet_size) */
+    ca = GET_CONFIG_CA_ALGORITM(handle->um_buffer_config);
+    if(GET_CONFIG_DIR(handle->um_buffer_config) == UM_BUFFER_CONFIG_DIR_OUT &&
+       (ca == UM_BUFFER_CONFIG_CA_FEEDBACK || ca == UM_BUFFER_CONFIG_CA_STRETCH))
+    {
+        rx_nodes = target + handle->um_node_size + ((handle->um_usb_packet_size + handle->um_sample_size) << 1);
+        rx_nodes = (rx_nodes + handle->um_node_size - 1) / handle->um_node_size;
+        nodes = rx_nodes > nodes ? rx_nodes : nodes;
+    }
+
+    node_count = UM_MIN_NODE_COUNT;
+    while(node_count < nodes)
+        node_count <<= 1;
+
+    UM_RET_IF_FALSE(node_count <= handle->um_node_capacity, UM_ENOMEM);
+
+    stop_hw(handle);
+
+    handle->um_target_fill = target;
+    set_node_count(handle, node_count);
+
+    handle->cur_um_node_for_hw = 0;
+    reset_usb_position(handle, 0);
+
+    /* bucket has been moved together with the end of the ring */
+    if(GET_CONFIG_CA_ALGORITM(handle->um_buffer_config) == UM_BUFFER_CONFIG_CA_ASRC)
+    {
+        um_asrc_restart(&handle->asrc, (int16_t *)handle->congestion_avoidance_bucket);
+    }
+
+    return UM_EOK;
+}
+
+uint32_t um_handle_get_target_latency(struct um_buffer_handle *handle)
+{
+    UM_RET_IF_FALSE(handle != NULL, 0);
+
+    return (handle->um_target_fill * 1000) / handle->um_usb_packet_size;
+}
+
+int um_handle_set_settle_time(struct um_buffer_handle *handle, uint32_t settle_us)
+{
+    UM_RET_IF_FALSE(handle != NULL, UM_EARGS);
+    UM_RET_IF_FALSE(GET_CONFIG_DIR(handle->um_buffer_config) == UM_BUFFER_CONFIG_DIR_IN, UM_EARGS);
+
+    /* whole nodes are dropped; it is used by the next hardware start */
+    handle->um_settle_fill = (settle_us * handle->um_usb_packet_size) / 1000;
+
+    return UM_EOK;
+}
+
+int um_handle_reconfigure(struct um_buffer_handle *handle,
+                          uint32_t usb_packet_size,
+                          uint32_t sample_size,
+                          uint32_t usb_frame_in_um_node_count,
+                          uint32_t um_node_count,
+                          uint8_t config)
+{
+    uint32_t latency_us, settle_us;
+    int result;
+
+    UM_RET_IF_FALSE(handle != NULL, UM_EARGS);
+    UM_RET_IF_FALSE(handle->um_buffer != NULL, UM_ESATE);
+    /* hardware callbacks are bound to direction */
+    UM_RET_IF_FALSE(GET_CONFIG_DIR(config) == GET_CONFIG_DIR(handle->um_buffer_config), UM_EARGS);
+
+    /* old geometry is kept, if the new one does not fit */
+    result = check_config(handle->um_mem_size, usb_packet_size, sample_size, usb_frame_in_um_node_count, um_node_count, config);
+    UM_RET_IF_FALSE(result == UM_EOK, result);
+
+    latency_us = um_handle_get_target_latency(handle);
+    settle_us = (handle->um_settle_fill * 1000) / handle->um_usb_packet_size;
+
+    stop_hw(handle);
+
+    set_geometry(handle, handle->um_buffer, usb_packet_size, sample_size, usb_frame_in_um_node_count, um_node_count, config);
+    reset_watermarks(handle);
+
+    if(settle_us != 0)
+        um_handle_set_settle_time(handle, settle_us);
+
+    /* latency in time is kept; ring stays as it has been laid out, if the latency does not fit into it */
+    return um_handle_set_target_latency(handle, latency_us);
+}
+
+void um_handle_set_hw_position(struct um_buffer_handle *handle, um_hw_position_fnc hw_position)
+{
+    UM_RET_IF_FALSE(handle != NULL,);
+
+    handle->um_hw_position = hw_position;
+}
+
+uint32_t um_handle_get_fill_bytes(struct um_buffer_handle *handle)
+{
+    UM_RET_IF_FALSE(handle != NULL, 0);
+
+    return get_fill_bytes(handle, UM_HANDLE_GEOMETRY(handle));
+}
+
+uint32_t um_handle_get_fill_samples(struct um_buffer_handle *handle)
+{
+    UM_RET_IF_FALSE(handle != NULL, 0);
+
+    return get_fill_bytes(handle, UM_HANDLE_GEOMETRY(handle)) / handle->um_sample_size;
+}
+
+uint8_t um_handle_get_fill_percentage(struct um_buffer_handle *handle)
+{
+    uint32_t total, fill;
+
+    UM_RET_IF_FALSE(handle != NULL, 0);
+
+    total = handle->um_node_size * handle->um_number_of_nodes;
+    fill = get_fill_bytes(handle, UM_HANDLE_GEOMETRY(handle));
+
+    return fill >= total ? 100 : (fill * 100) / total;
 }
 
 uint32_t um_handle_register_listener(struct um_buffer_handle *handle, enum um_buffer_listener_type type, listener_callback clbk)
+{
+    UM_RET_IF_FALSE(handle != NULL, UM_LISTENERS_WRONG_ID);
+    UM_RET_IF_FALSE(type < UM_LISTENER_TYPE_COUNT, UM_LISTENERS_WRONG_ID);
+    /* watermark listener needs its level */
+    UM_RET_IF_FALSE(type != UM_LISTENER_TYPE_WATERMARK, UM_LISTENERS_WRONG_ID);
+    UM_RET_IF_FALSE(clbk != NULL, UM_LISTENERS_WRONG_ID);
+
+    return add_listener(handle, type, clbk);
+}
+
+uint32_t um_handle_register_watermark(struct um_buffer_handle *handle,
+                                      uint8_t watermark, uint8_t hysteresis, uint16_t min_interval,
+                                      listener_callback clbk)
 {
     uint32_t result;
+    struct um_buffer_listener *listener;
 
     UM_RET_IF_FALSE(handle != NULL, UM_LISTENERS_WRONG_ID);
-    UM_RET_IF_FALSE(type < UM_LISTENER_TYPE_COUNT, UM_LISTENERS_WRONG_ID);
     UM_RET_IF_FALSE(clbk != NULL, UM_LISTENERS_WRONG_ID);
+    UM_RET_IF_FALSE(watermark <= 100 && hysteresis != 0 && hysteresis <= watermark, UM_LISTENERS_WRONG_ID);
 
-    result = allocate_listeners_from_pool(type);
+    result = add_listener(handle, UM_LISTENER_TYPE_WATERMARK, clbk);
 
     UM_RET_IF_FALSE(result != UM_LISTENERS_WRONG_ID, UM_LISTENERS_WRONG_ID);
 
-    if(handle->listeners[type] == NULL)
-    {
-        handle->listeners[type] = &(_listener_pool[type][result]);
-        handle->listeners[type]->listener_handle = clbk;
-    }
-    else
-    {
-        struct um_buffer_listener *last = _get_last_listener(handle->listeners[type]);
-        last->next = &(_listener_pool[type][result]);
-        last->next->listener_handle = clbk;
-    }
+    listener = &(_listener_pool[UM_LISTENER_TYPE_WATERMARK][result]);
+    listener->watermark = watermark;
+    listener->hysteresis = hysteresis;
+    listener->min_interval = min_interval;
+    listener->side = UM_WATERMARK_UNKNOWN;
+    /* first crossing is reported without delay */
+    listener->last_event = handle->um_packet_count - min_interval;
 
     return result;
 }
@@ -459,8 +1224,8 @@ void um_handle_unregister_listener(struct um_buffer_handle *handle, enum um_buff
     struct um_buffer_listener *curr;
 
     UM_RET_IF_FALSE(handle != NULL,);
-    UM_RET_IF_FALSE(handle->listeners[type] != NULL,);
     UM_RET_IF_FALSE(type < UM_LISTENER_TYPE_COUNT,);
+    UM_RET_IF_FALSE(handle->listeners[type] != NULL,);
     UM_RET_IF_FALSE(listener_id < UM_BUFFER_LISTENER_COUNT,);
 
     curr = handle->listeners[type];
@@ -470,61 +1235,147 @@ void um_handle_unregister_listener(struct um_buffer_handle *handle, enum um_buff
         curr->listener_handle = NULL;
         handle->listeners[type] = curr->next;
         curr->next = NULL;
+        return;
     }
 
     while(curr->next != NULL)
     {
         if(curr->next->id == listener_id)
         {
-            curr->next->listener_handle = NULL;
-            curr->next = curr->next->next;
-            curr->next->next = NULL;
+            struct um_buffer_listener *removed = curr->next;
+
+            removed->listener_handle = NULL;
+            curr->next = removed->next;
+            removed->next = NULL;
             return;
         }
+        curr = curr->next;
+    }
+}
+
+/* OUT: next node is handed to DMA only when USB side has passed the node, which is being played now (or,
+ * when conceal node is being played, has finished the next one); otherwise conceal node is played */
+static void audio_dma_complete_out(struct um_buffer_handle *handle)
+{
+    uint8_t state = handle->um_conceal_state;
+    uint8_t playing = state & UM_CONCEAL_QUEUED;
+    uint32_t hw_node = handle->cur_um_node_for_hw + (playing ? 0 : 1);
+    uint32_t usb_node = handle->cur_um_node_for_usb;
+
+    /* stream has been stopped; the rest of it is dropped once, and the next one is primed from the current USB node */
+    if(playing && handle->um_standby && !(state & UM_CONCEAL_DROPPED))
+    {
+        if((int32_t)(usb_node - 1 - hw_node) > 0)
+            hw_node = usb_node - 1;
+
+        state |= UM_CONCEAL_DROPPED;
+    }
+
+    /* fade out has been played and DMA has just started it again; it is overwritten well ahead of DMA */
+    if(playing && (state & UM_CONCEAL_PLAYING) && (state & UM_CONCEAL_FADED))
+    {
+        memset(handle->um_conceal_node, 0, handle->um_node_size);
+        state &= ~UM_CONCEAL_FADED;
+    }
+
+    if(!handle->um_standby && (int32_t)(usb_node - hw_node - (playing ? 1 : 0)) > 0)
+    {
+        /* node is complete and USB side does not touch it any more */
+        if(playing)
+            conceal_ramp(handle, (int16_t *)UM_NODE(handle, hw_node + 1)->um_buf, (int16_t *)UM_NODE(handle, hw_node + 1)->um_buf, 1);
+
+        handle->um_next_node(UM_ADDR(UM_NODE(handle, hw_node + 1)->um_buf));
+        state &= ~(UM_CONCEAL_QUEUED | UM_CONCEAL_DROPPED);
+    }
+    else
+    {
+        if(!playing)
+        {
+            /* underrun (USB side is still in the node, which is being played now) or standby;
+             * last complete node is repeated fading out */
+            conceal_ramp(handle, (int16_t *)handle->um_conceal_node, (int16_t *)UM_NODE(handle, hw_node - 1)->um_buf, 0);
+            state |= UM_CONCEAL_FADED;
+
+            if(!handle->um_standby)
+                handle->um_underruns++;
+        }
+
+        handle->um_next_node(UM_ADDR(handle->um_conceal_node));
+        state |= UM_CONCEAL_QUEUED;
     }
+
+    /* USB side reads node index first, so it never sees new index together with old conceal state */
+    handle->um_conceal_state = (state & ~UM_CONCEAL_PLAYING) | (playing ? UM_CONCEAL_PLAYING : 0);
+    UM_DMB();
+    handle->cur_um_node_for_hw = hw_node;
 }
 
-#pragma GCC diagnostic ignored "-Wimplicit-fallthrough"
 void audio_dma_complete_cb(struct um_buffer_handle *handle)
 {
-    /* State machine verification */
-    UM_VERIFY(handle->cur_um_node_for_hw->um_node_state == UM_NODE_STATE_UNDER_HW || handle->cur_um_node_for_hw->um_node_state == UM_NODE_STATE_INITIAL);
+    uint32_t hw_node, usb_node;
 
-    handle->cur_um_node_for_hw->um_node_state = UM_NODE_STATE_HW_FINISHED;
-    handle->cur_um_node_for_hw = handle->cur_um_node_for_hw->next;
+    /* transfer may be completed right before hardware was paused */
+    if(handle->um_buffer_state != UM_BUFFER_STATE_PLAY)
+        return;
 
-    switch (handle->cur_um_node_for_hw->um_node_state)
+    if(GET_CONFIG_DIR(handle->um_buffer_config) == UM_BUFFER_CONFIG_DIR_OUT)
     {
-    case UM_NODE_STATE_UNDER_USB:
-        /* This state may occure, if new buffer node is under 
-        USB packet filling, but not finish and no more packet
-        is coming from USB endpoint. */
+        audio_dma_complete_out(handle);
+        return;
+    }
 
-        /* Verify. that cur_um_node_for_hw equal to cur_um_node_for_usb */
-        UM_VERIFY(handle->cur_um_node_for_hw == handle->cur_um_node_for_usb);
+    hw_node = handle->cur_um_node_for_hw + 1;
+    usb_node = handle->cur_um_node_for_usb;
 
-        /* keep handling it as for UM_NODE_STATE_HW_FINISHED state */
-    case UM_NODE_STATE_HW_FINISHED:
-        um_handle_pause(handle);
-        break;
-    case UM_NODE_STATE_INITIAL:
-    case UM_NODE_STATE_USB_FINISHED:
-        handle->cur_um_node_for_hw->um_node_state = UM_NODE_STATE_UNDER_HW;
-        break;
-    case UM_NODE_STATE_UNDER_HW:
-    default:
-        /* State machine error */
-        UM_VERIFY(0);
-        break;
+    /* DMA has already switched to hw_node; the memory it has just finished gets the node after it */
+    handle->um_next_node(UM_ADDR(UM_NODE(handle, hw_node + 1)->um_buf));
+
+    /* next node is still not read by USB: overflow; in standby hardware overwrites data, which nobody reads */
+    if(!handle->um_standby && (hw_node - usb_node) >= handle->um_number_of_nodes)
+    {
+        handle->um_pause_resume(0, UM_ADDR(handle->um_buffer), 0);
+
+        /* hardware is stopped; hand HW node index over to USB task context */
+        handle->cur_um_node_for_hw = hw_node;
+        UM_DMB();
+        handle->um_buffer_state = UM_BUFFER_STATE_READY;
+        return;
     }
+
+    handle->cur_um_node_for_hw = hw_node;
 }
 
 void free_um_buffer_handle(struct um_buffer_handle *handle)
 {
-    uint32_t timeout = 10000;
+    uint32_t i;
+
+    UM_RET_IF_FALSE(handle != NULL,);
+
+    /* stop hardware first; after that nobody touches the ring from interrupt context */
+    if(handle->um_buffer_state == UM_BUFFER_STATE_PLAY)
+    {
+        handle->um_pause_resume(0, UM_ADDR(handle->um_buffer), 0);
+    }
 
-    while (handle->um_buffer_state == UM_BUFFER_STATE_PLAY && timeout--);
+    /* return listeners of this handle back to the pool */
+    for(i = 0; i < UM_LISTENER_TYPE_COUNT; i++)
+    {
+        struct um_buffer_listener *curr = handle->listeners[i];
 
-    free(handle->start_um_node->um_buf);
-    _free_um_nodes(handle->start_um_node->next, handle->start_um_node);
+        while(curr != NULL)
+        {
+            struct um_buffer_listener *next = curr->next;
+
+            curr->listener_handle = NULL;
+            curr->next = NULL;
+            curr = next;
+        }
+        handle->listeners[i] = NULL;
+    }
+
+    /* memory block is owned by caller; just detach from it */
+    handle->um_nodes = NULL;
+    handle->um_buffer = NULL;
+    handle->congestion_avoidance_bucket = NULL;
+    handle->um_buffer_state = UM_BUFFER_STATE_INIT;
 }
\ No newline at end of file
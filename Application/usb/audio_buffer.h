@@ -3,15 +3,34 @@
 
 #include <stdint.h>
 
+#include "audio_asrc.h"
+
+#if defined(__arm__)
+
 #define BREAK do                                                                                            \
 {                                                                                                           \
     volatile uint32_t* ARM_CM_DHCSR =  ((volatile uint32_t*) 0xE000EDF0UL); /* Cortex M CoreDebug->DHCSR */ \
     if ( (*ARM_CM_DHCSR) & 1UL ) __asm("BKPT #0\n"); /* Only halt mcu if debugger is attached */            \
 } while(0)
 
+#define UM_HALT()                           while(1){}
+
+/* Orders ring memory accesses against the update of the USB/HW node index,
+ * which is observed from the other (task or DMA interrupt) context */
+#define UM_DMB()                            __asm volatile ("dmb" ::: "memory")
+
+#else /* host build: simulator, stress test, benchmarks */
+
+#define BREAK                               do {} while(0)
+#define UM_HALT()                           __builtin_trap()
+/* index handoff needs release on the writer and acquire on the reader, not a full fence */
+#define UM_DMB()                            __atomic_thread_fence(__ATOMIC_ACQ_REL)
+
+#endif
+
 #define UM_VERIFY(cond)  do                 \
 {                                           \
-    if( !(cond) ) { BREAK; while(1){} }     \
+    if( !(cond) ) { BREAK; UM_HALT(); }     \
 } while(0)
 
 #define UM_RET_IF_FALSE(cond, retval) do    \
@@ -19,24 +38,31 @@
     if( !(cond) ) { BREAK; return retval; } \
 } while(0)
 
+/* Memory addresses are passed to hardware callbacks as 32 bit values */
+#define UM_ADDR(ptr)                        ((uint32_t)(uintptr_t)(ptr))
+
 
-#define CW_LOWER_BOUND                      1
-#define CW_UPPER_BOUND                      3
+#define UM_BUFFER_CONFIG_DIR_OUT            0x00
+#define UM_BUFFER_CONFIG_DIR_IN             0x01
 
 #define UM_BUFFER_CONFIG_CA_NONE            0x00
-#define UM_BUFFER_CONFIG_CA_DROP_HALF_PKT   0x02
+/* Drops or duplicates single frames of the packet at its quietest point */
+#define UM_BUFFER_CONFIG_CA_STRETCH         0x02
+#define UM_BUFFER_CONFIG_CA_DROP_HALF_PKT   UM_BUFFER_CONFIG_CA_STRETCH
+/* OUT: host rate follows feedback endpoint; IN: packet size follows fill level (see um_handle_read) */
 #define UM_BUFFER_CONFIG_CA_FEEDBACK        0x04
+#define UM_BUFFER_CONFIG_CA_ASRC            0x08
 
 #define UM_BUFFER_FLAG_CONGESTION_AVIODANCE 0x2
-#define UM_BUFFER_FLAG_HALF_USB_FRAME       0x1
+#define UM_BUFFER_FLAG_PREROLL              0x4
 
-#define GET_CONFIG_CA_ALGORITM(config)      ((config) & (UM_BUFFER_CONFIG_CA_DROP_HALF_PKT | UM_BUFFER_CONFIG_CA_FEEDBACK))
+#define GET_CONFIG_CA_ALGORITM(config)      ((config) & (UM_BUFFER_CONFIG_CA_STRETCH | UM_BUFFER_CONFIG_CA_FEEDBACK | UM_BUFFER_CONFIG_CA_ASRC))
+#define GET_CONFIG_DIR(config)              ((config) & UM_BUFFER_CONFIG_DIR_IN)
 
 #define GET_CONGESTION_AVOIDANCE_FLAG(flag) ((flag) & UM_BUFFER_FLAG_CONGESTION_AVIODANCE)
-#define GET_HALF_USB_FRAME_FLAG(flag)       ((flag) & UM_BUFFER_FLAG_HALF_USB_FRAME)
+#define GET_PREROLL_FLAG(flag)              ((flag) & UM_BUFFER_FLAG_PREROLL)
 
 #define TOGGLE_CONGESTION_AVOIDANCE_FLAG(flag)  (flag) = ((flag) ^ UM_BUFFER_FLAG_CONGESTION_AVIODANCE)
-#define TOGGLE_HALF_USB_FRAME_FLAG(flag)        (flag) = ((flag) ^ UM_BUFFER_FLAG_HALF_USB_FRAME)
 
 #define UM_EOK                              0
 #define UM_ENOMEM                           -1
@@ -46,14 +72,21 @@
 
 #define UM_LISTENERS_WRONG_ID               __UINT32_MAX__
 
-enum um_node_state
-{
-    UM_NODE_STATE_HW_FINISHED = 0,
-    UM_NODE_STATE_UNDER_USB,
-    UM_NODE_STATE_USB_FINISHED,
-    UM_NODE_STATE_UNDER_HW,
-    UM_NODE_STATE_INITIAL = 0xFF
-};
+#define UM_ALIGN4(size)                     (((size) + 3UL) & ~3UL)
+
+/* CA bucket keeps the part of USB packet, which is not fit in the end of the buffer.
+ * Host may send packet bigger than nominal one, so reserve two packets for it.
+ * With CA_ASRC USB packet is received into the bucket right after resampler history */
+#define UM_CA_BUCKET_SIZE(usb_packet_size)  ((usb_packet_size) << 1)
+
+/* Fewest nodes of the ring (node count is power of two): two are owned by DMA, one by USB and one is spare */
+#define UM_MIN_NODE_COUNT                   4
+
+/* Size of the memory block, which should be passed to um_handle_init.
+ * Block holds audio data for all nodes, CA bucket, conceal node and node descriptors */
+#define UM_BUFFER_MEM_SIZE(usb_packet_size, usb_frame_in_um_node_count, um_node_count)     \
+    (UM_ALIGN4(((usb_packet_size) * (usb_frame_in_um_node_count) * ((um_node_count) + 1)) + UM_CA_BUCKET_SIZE(usb_packet_size)) \
+    + ((um_node_count) * sizeof(struct um_node)))
 
 enum um_buffer_state
 {
@@ -64,7 +97,10 @@ enum um_buffer_state
 
 enum um_buffer_listener_type
 {
+    /* called with fill percentage for every packet */
     UM_LISTENER_TYPE_CA = 0,
+    /* called with struct um_watermark_event, when level crosses watermark */
+    UM_LISTENER_TYPE_WATERMARK,
 
     UM_LISTENER_TYPE_COUNT
 };
@@ -72,54 +108,192 @@ enum um_buffer_listener_type
 struct um_node
 {
     uint8_t *um_buf;
-    struct um_node *next;
-    uint32_t um_node_offset;
-    enum um_node_state um_node_state;
 };
 
 struct um_buffer_listener;
 
+struct um_span
+{
+    uint8_t *ptr;
+    uint32_t size;
+};
+
+/* Level is the percentage passed to CA listeners: free space for OUT, data ready for IN; target fill is 50% */
+struct um_watermark_event
+{
+    uint8_t watermark;
+    uint8_t level;
+    /* 1: level has reached watermark; 0: level has dropped to watermark minus hysteresis */
+    uint8_t rising;
+};
+
 struct um_buffer_handle
 {
-    struct um_node *cur_um_node_for_hw;
-    struct um_node *cur_um_node_for_usb;
-    struct um_node *start_um_node;
+    struct um_node *um_nodes;
+    uint8_t *um_buffer;
     uint8_t *congestion_avoidance_bucket;
 
+    /* Free running node indexes (wrapped with um_node_mask on access).
+     * cur_um_node_for_usb and um_usb_node_offset are written only from USB task context.
+     * cur_um_node_for_hw is written only from DMA interrupt context while buffer is in PLAY state;
+     * in other states hardware is stopped and index belongs to USB task context. */
+    volatile uint32_t cur_um_node_for_hw;
+    volatile uint32_t cur_um_node_for_usb;
+    uint32_t um_usb_node_offset;
+    /* Free running count of bytes passed by USB side; together with cur_um_node_for_hw
+     * gives exact fill level without walking the nodes */
+    uint32_t um_usb_bytes;
+
     uint32_t um_usb_packet_size;
+    uint32_t um_sample_size;
+    uint32_t um_node_size;
     uint16_t um_usb_frame_in_node;
     uint16_t um_number_of_nodes;
+    uint16_t um_node_mask;
+    uint16_t um_node_capacity;
     uint32_t um_abs_offset;
 
     uint32_t um_buffer_size_in_one_node;
     uint32_t total_buffer_size;
+    /* fill level in bytes to start hardware with; also set-point for CA listeners */
+    uint32_t um_target_fill;
+    /* CA_STRETCH: low pass filtered difference between fill level and target, samples in Q8 */
+    int32_t um_fill_error;
 
-    enum um_buffer_state um_buffer_state;
+    volatile enum um_buffer_state um_buffer_state;
     uint8_t um_buffer_flags;
     uint8_t um_buffer_config;
     struct um_buffer_listener *listeners[UM_LISTENER_TYPE_COUNT];
+    /* packets passed in PLAY state; time base of watermark rate limit */
+    uint32_t um_packet_count;
 
     void (*um_play)(uint32_t addr, uint32_t size);
     uint32_t (*um_pause_resume)(uint32_t Cmd, uint32_t Addr, uint32_t Size);
+    void (*um_next_node)(uint32_t addr);
+    uint32_t (*um_hw_position)(void);
+
+    struct um_asrc asrc;
+
+    /* OUT: node played instead of the ring after underrun, until USB side catches up; DMA keeps running.
+     * Holds the last complete node faded out, then silence. um_conceal_state is owned by interrupt context.
+     * IN: always silent; sent to USB, until capture has settled after hardware start */
+    uint8_t *um_conceal_node;
+    volatile uint8_t um_conceal_state;
+    /* count of underruns, which were concealed */
+    volatile uint32_t um_underruns;
+    /* Stream is idle, but hardware keeps running: OUT plays conceal node until stream is primed again,
+     * IN overwrites the ring until USB reads again. Written from USB task context */
+    volatile uint8_t um_standby;
+    /* IN: capture, which is dropped after hardware start, while analog front end settles */
+    uint32_t um_settle_fill;
+    /* size of memory block passed to um_handle_init; um_handle_reconfigure lays the ring out inside it */
+    uint32_t um_mem_size;
 };
 
 typedef void (*listener_callback)(void *args);
 typedef void (*um_play_fnc)(uint32_t addr, uint32_t size);
 typedef uint32_t (*um_pause_resume_fnc)(uint32_t Cmd, uint32_t Addr, uint32_t Size);
+/* Points idle memory of double buffered DMA to the next node; called on each transfer complete */
+typedef void (*um_next_node_fnc)(uint32_t addr);
+/* Returns address of the memory, which hardware (DMA) is going to access next */
+typedef uint32_t (*um_hw_position_fnc)(void);
+
+#define UM_NODE(handle, idx)                (&(handle)->um_nodes[(idx) & (handle)->um_node_mask])
+#define UM_CUR_NODE_FOR_USB(handle)         UM_NODE(handle, (handle)->cur_um_node_for_usb)
+#define UM_CUR_NODE_FOR_HW(handle)          UM_NODE(handle, (handle)->cur_um_node_for_hw)
 
 int um_handle_init( struct um_buffer_handle *handle,
+                    uint8_t *mem, uint32_t mem_size,
                     uint32_t usb_packet_size,
+                    uint32_t sample_size,
                     uint32_t usb_frame_in_um_node_count,
                     uint32_t um_node_count,
                     uint8_t configs,
-                    um_play_fnc play, um_pause_resume_fnc pause_resume );
-
+                    um_play_fnc play, um_pause_resume_fnc pause_resume,
+                    um_next_node_fnc next_node );
+
+/* Changes packet size, sample size, node geometry and CA mode (not direction) inside the memory block of
+ * um_handle_init, e.g. on sample rate or format change. Hardware is stopped, if it is running, and is started
+ * by the next enqueue/dequeue with the new node size. Callbacks, listeners, target latency and settle time are kept.
+ * On UM_EARGS/UM_ENOMEM old geometry is kept, unless only target latency does not fit: then it is half of the ring */
+int um_handle_reconfigure(struct um_buffer_handle *handle,
+                          uint32_t usb_packet_size,
+                          uint32_t sample_size,
+                          uint32_t usb_frame_in_um_node_count,
+                          uint32_t um_node_count,
+                          uint8_t configs);
+
+/* Passes packet, which has been received to the pointer returned by previous enqueue
+ * (first one to UM_CUR_NODE_FOR_USB), and returns where the next packet should be received to */
 uint8_t *um_handle_enqueue(struct um_buffer_handle *handle, uint16_t pkt_size);
 uint8_t *um_handle_dequeue(struct um_buffer_handle *handle, uint16_t pkt_size);
 
+/* Zero-copy alternative of um_handle_enqueue for OUT stream. Reserve gives one or two (when the ring wraps) spans
+ * to write up to max_bytes to; returns count of spans or 0, if there is no room and packet should be dropped.
+ * Commit passes written bytes (not more than reserved) to hardware side; returns UM_EBUFOVERFLOW, if packet is dropped */
+uint32_t um_handle_reserve(struct um_buffer_handle *handle, uint32_t max_bytes, struct um_span span[2]);
+int um_handle_commit(struct um_buffer_handle *handle, uint32_t bytes);
+/* For receivers, which write into the ring on their own (USB peripheral): returns how many bytes may be written
+ * starting from ring offset (wrapping at total_buffer_size) without touching audio, which is not played yet.
+ * Data written there is passed with um_handle_commit. Only CA_FEEDBACK and CA_STRETCH; 0 for other modes */
+uint32_t um_handle_get_rx_window(struct um_buffer_handle *handle, uint32_t *offset);
+/* IN counterpart of reserve/commit: passes the next packet to USB side as one or two (when the ring wraps) spans;
+ * returns count of spans or 0 on underrun. Silent node is given during preroll. With CA_FEEDBACK the packet
+ * is one frame longer or shorter than um_usb_packet_size to keep fill at target (asynchronous IN endpoint);
+ * steady sizes need hardware position. um_handle_dequeue gives only fixed size packets of CA_NONE */
+uint32_t um_handle_read(struct um_buffer_handle *handle, struct um_span span[2]);
+/* Starts capture of IN stream without taking a packet (interface is switched to streaming alt setting);
+ * the following reads send silence during preroll as after a start by read. Running hardware is kept */
+int um_handle_start(struct um_buffer_handle *handle);
+
+/* Streams known at build time get fast paths of commit/read, specialised on their geometry (divisions by constants,
+ * no CA mode switch). UM_STREAMS_CONFIG names a header, which defines stream table UM_STREAMS(OUT, IN) as
+ * OUT(name, ca, packet_size, sample_size, frames_in_node) and IN(...) entries; um_handle_commit_<name> and
+ * um_handle_read_<name> are generated for them. Handle of another geometry (reconfigured) takes the generic path */
+#ifdef UM_STREAMS_CONFIG
+#include UM_STREAMS_CONFIG
+#endif
+
+#ifdef UM_STREAMS
+#define UM_STREAM_OUT_PROTO(name, ca, packet_size, sample_size, frames_in_node) \
+    int um_handle_commit_##name(struct um_buffer_handle *handle, uint32_t bytes);
+#define UM_STREAM_IN_PROTO(name, ca, packet_size, sample_size, frames_in_node) \
+    uint32_t um_handle_read_##name(struct um_buffer_handle *handle, struct um_span span[2]);
+
+UM_STREAMS(UM_STREAM_OUT_PROTO, UM_STREAM_IN_PROTO)
+#endif
+
 void um_handle_pause(struct um_buffer_handle *handle);
+/* Alternative to pause for idle stream: DMA is kept running, so the next stream does not restart hardware.
+ * OUT plays silence and restarts with target latency; IN continues with the latest target latency of capture */
+void um_handle_standby(struct um_buffer_handle *handle);
+
+/* Sets start threshold (and set-point for CA listeners) in microseconds of audio and uses
+ * as many nodes as needed to keep it in the middle of the ring. Stops hardware, if it is running;
+ * stream is started again by the next enqueue/dequeue. With OUT CA_FEEDBACK and CA_STRETCH the ring also
+ * keeps um_handle_get_rx_window open for the largest packet; UM_ENOMEM, if node capacity is too short for it */
+int um_handle_set_target_latency(struct um_buffer_handle *handle, uint32_t latency_us);
+uint32_t um_handle_get_target_latency(struct um_buffer_handle *handle);
+/* IN only: microseconds of capture dropped after hardware start (mic power up, filters, DC offset).
+ * Zeros are sent meanwhile, and the stream fades in from the first captured node */
+int um_handle_set_settle_time(struct um_buffer_handle *handle, uint32_t settle_us);
+
+/* Optional; with hardware position fill level is tracked inside the node, not only at node boundaries */
+void um_handle_set_hw_position(struct um_buffer_handle *handle, um_hw_position_fnc hw_position);
+
+/* Amount of audio data in the buffer, which is not yet passed to the consumer
+ * (hardware for OUT, USB for IN). sample_size is size of one sample of all channels */
+uint32_t um_handle_get_fill_bytes(struct um_buffer_handle *handle);
+uint32_t um_handle_get_fill_samples(struct um_buffer_handle *handle);
+uint8_t um_handle_get_fill_percentage(struct um_buffer_handle *handle);
 
 uint32_t um_handle_register_listener(struct um_buffer_handle *handle, enum um_buffer_listener_type type, listener_callback clbk);
+/* Listener is called only when level crosses watermark, and not more often than once per min_interval packets.
+ * Level has to drop to watermark minus hysteresis (at least 1) to be reported as falling. After stream start
+ * the first level outside of the hysteresis band is reported. Removed with um_handle_unregister_listener */
+uint32_t um_handle_register_watermark(struct um_buffer_handle *handle,
+                                      uint8_t watermark, uint8_t hysteresis, uint16_t min_interval,
+                                      listener_callback clbk);
 void um_handle_unregister_listener(struct um_buffer_handle *handle, enum um_buffer_listener_type type, uint32_t listener_id);
 
 void audio_dma_complete_cb(struct um_buffer_handle *handle);
@@ -0,0 +1,129 @@
+#include "audio_feedback.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* Fill error low pass filter, (1 / 64) per packet: fill moves by a sample with every packet boundary */
+#define UM_FB_ERROR_FILTER_SHIFT            6
+#define UM_FB_ERROR_FRAC_BITS               8
+/* Proportional gain: 1/2048 sample per frame per sample of fill error; Q8 error shifted is 16.16 */
+#define UM_FB_KP_SHIFT                      3
+/* Integral gain: Q8 error summed per packet, shifted is 16.16 */
+#define UM_FB_KI_SHIFT                      17
+/* Integral is bounded, its term is then within 1/8 sample per frame: the estimate carries the rate itself */
+#define UM_FB_INTEGRAL_LIMIT                (1L << 30)
+/* Fill level only: integral carries the whole clock offset, up to the output limit;
+ * critically damped, time constant of 512 frames */
+#define UM_FB_FILL_KP_SHIFT                 1
+#define UM_FB_FILL_KI_SHIFT                 12
+#define UM_FB_FILL_INTEGRAL_LIMIT           (UM_FB_ONE_SAMPLE << UM_FB_FILL_KI_SHIFT)
+/* Frame, which count is away from nominal by more than 1/8 of it, is an outlier */
+#define UM_FB_OUTLIER_SHIFT                 3
+
+static inline int32_t um_fb_clamp(int32_t value, int32_t limit)
+{
+    return value > limit ? limit : (value < -limit ? -limit : value);
+}
+
+void um_fb_init(struct um_fb *fb, uint32_t nominal, uint32_t mclk_shift)
+{
+    memset(fb, 0, sizeof(*fb));
+
+    fb->nominal = nominal;
+    fb->mclk_shift = (uint8_t)mclk_shift;
+    fb->nominal_count = (nominal << mclk_shift) >> 16;
+    fb->kp_shift = UM_FB_KP_SHIFT;
+    fb->ki_shift = UM_FB_KI_SHIFT;
+    fb->integral_limit = UM_FB_INTEGRAL_LIMIT;
+}
+
+void um_fb_init_fill(struct um_fb *fb, uint32_t nominal)
+{
+    um_fb_init(fb, nominal, 0);
+
+    fb->kp_shift = UM_FB_FILL_KP_SHIFT;
+    fb->ki_shift = UM_FB_FILL_KI_SHIFT;
+    fb->integral_limit = UM_FB_FILL_INTEGRAL_LIMIT;
+}
+
+void um_fb_restart(struct um_fb *fb)
+{
+    fb->error = 0;
+    fb->correction = um_fb_clamp(-(fb->integral >> fb->ki_shift), UM_FB_ONE_SAMPLE);
+}
+
+void um_fb_add_frames(struct um_fb *fb, const uint32_t *mclk_counts, uint32_t count)
+{
+    uint32_t i;
+
+    for(i = 0; i < count; i++)
+    {
+        uint32_t mclk = mclk_counts[i];
+        uint32_t deviation = mclk > fb->nominal_count ? mclk - fb->nominal_count : fb->nominal_count - mclk;
+
+        if(deviation > (fb->nominal_count >> UM_FB_OUTLIER_SHIFT))
+            continue;
+
+        /* the oldest frame leaves the window, once it is full */
+        if(fb->frames == UM_FB_WINDOW)
+            fb->sum -= fb->counts[fb->head];
+        else
+            fb->frames++;
+
+        fb->counts[fb->head] = (uint16_t)mclk;
+        fb->sum += mclk;
+        fb->head = (fb->head + 1) & (UM_FB_WINDOW - 1);
+    }
+}
+
+void um_fb_update(struct um_fb *fb, int32_t fill_error)
+{
+    fb->error += ((fill_error * (1 << UM_FB_ERROR_FRAC_BITS)) - fb->error) >> UM_FB_ERROR_FILTER_SHIFT;
+
+    /* integral is not wound up beyond what the output can take */
+    fb->integral = um_fb_clamp(fb->integral + fb->error, fb->integral_limit);
+
+    /* more data than target: host should send less */
+    fb->correction = um_fb_clamp(-((fb->error >> fb->kp_shift) + (fb->integral >> fb->ki_shift)), UM_FB_ONE_SAMPLE);
+}
+
+uint32_t um_fb_value(struct um_fb *fb)
+{
+    uint32_t estimate = fb->nominal;
+    int32_t delta;
+
+    if(fb->frames == UM_FB_WINDOW)
+        estimate = (uint32_t)(((uint64_t)fb->sum << 16) >> (fb->mclk_shift + UM_FB_WINDOW_BITS));
+    else if(fb->frames != 0)
+        estimate = (uint32_t)(((uint64_t)fb->sum << 16) / ((uint64_t)fb->frames << fb->mclk_shift));
+
+    delta = um_fb_clamp((int32_t)(estimate - fb->nominal) + fb->correction, UM_FB_ONE_SAMPLE);
+
+    return (uint32_t)((int32_t)fb->nominal + delta);
+}
+
+void um_fb_post(struct um_fb_mailbox *mb, uint32_t value)
+{
+    uint32_t seq = (mb->slot >> UM_FB_MAILBOX_SEQ_SHIFT) + 1;
+
+    mb->slot = (seq << UM_FB_MAILBOX_SEQ_SHIFT) | (value & UM_FB_MAILBOX_VALUE_MASK);
+    mb->posted++;
+}
+
+uint8_t um_fb_take(struct um_fb_mailbox *mb, uint32_t *value)
+{
+    uint32_t slot = mb->slot;
+    uint8_t seq = (uint8_t)(slot >> UM_FB_MAILBOX_SEQ_SHIFT);
+    uint8_t missed = (uint8_t)(seq - mb->taken_seq);
+
+    if(missed == 0)
+        return 0;
+
+    /* values posted in between were never sent */
+    mb->overwritten += missed - 1U;
+    mb->taken++;
+    mb->taken_seq = seq;
+    *value = slot & UM_FB_MAILBOX_VALUE_MASK;
+
+    return 1;
+}
@@ -0,0 +1,86 @@
+#ifndef __AUDIO_FEEDBACK_INIT___
+#define __AUDIO_FEEDBACK_INIT___
+
+#include <stdint.h>
+
+/* Explicit feedback of asynchronous OUT endpoint (UM_BUFFER_CONFIG_CA_FEEDBACK), 16.16 samples per frame.
+ * Device rate is MCLK counted in each USB frame (SOF to SOF), averaged over the last UM_FB_WINDOW frames;
+ * running sum makes it O(1) per frame, and one MCLK cycle over the window is its resolution.
+ * PI controller on fill error corrects the estimate, so fill level converges to its target.
+ * Without MCLK capture (um_fb_init_fill) there is no estimate: faster PI controller alone finds the rate from fill level.
+ * Value never leaves nominal +-1 sample per frame (UAC2 FMT-2.0 2.3.1.1) */
+#define UM_FB_WINDOW_BITS                   8
+#define UM_FB_WINDOW                        (1 << UM_FB_WINDOW_BITS)
+
+/* One sample per frame, 16.16 */
+#define UM_FB_ONE_SAMPLE                    (1L << 16)
+
+struct um_fb
+{
+    /* MCLK cycles counted in each of the last frames, and their sum */
+    uint16_t counts[UM_FB_WINDOW];
+    uint32_t sum;
+    uint16_t head;
+    /* frames in the window, until it is full */
+    uint16_t frames;
+
+    uint32_t nominal;
+    uint32_t nominal_count;
+    uint8_t mclk_shift;
+
+    /* PI gains, as right shifts, and bound of the integral */
+    uint8_t kp_shift;
+    uint8_t ki_shift;
+    int32_t integral_limit;
+
+    /* PI controller state: low pass filtered fill error in samples (Q8) and its integral (Q8);
+     * correction of the estimate (16.16) is written by task and read by interrupt */
+    int32_t error;
+    int32_t integral;
+    volatile int32_t correction;
+};
+
+/* Latest value mailbox from the context feedback is computed in (capture interrupt, task) to the one it is sent from (SOF).
+ * Value and its 8 bit sequence share one word, so each side touches it with a single load or store and no lock;
+ * a value, which is not taken before the next one is posted, is overwritten: only the newest is sent */
+#define UM_FB_MAILBOX_SEQ_SHIFT             24
+#define UM_FB_MAILBOX_VALUE_MASK            ((1UL << UM_FB_MAILBOX_SEQ_SHIFT) - 1)
+
+struct um_fb_mailbox
+{
+    /* sequence << 24 | value, written by producer only */
+    volatile uint32_t slot;
+    uint32_t posted;
+
+    /* written by consumer only: sequence of the last value taken, values taken and never taken */
+    uint8_t taken_seq;
+    uint32_t taken;
+    uint32_t overwritten;
+};
+
+/* nominal: samples per frame, 16.16; MCLK is (1 << mclk_shift) times the sample rate */
+void um_fb_init(struct um_fb *fb, uint32_t nominal, uint32_t mclk_shift);
+
+/* Fill level is the only source: um_fb_add_frames is not used, um_fb_update is called once per frame (SOF) */
+void um_fb_init_fill(struct um_fb *fb, uint32_t nominal);
+
+/* Stream start: fill error is dropped; measured frames and learned integral are kept, clocks have not changed */
+void um_fb_restart(struct um_fb *fb);
+
+/* Interrupt context: MCLK cycles counted in each of the next count frames. Frame, which is more than 1/8
+ * away from nominal (missed SOF, first capture after timer start), is not taken into the window */
+void um_fb_add_frames(struct um_fb *fb, const uint32_t *mclk_counts, uint32_t count);
+
+/* Task context: difference between fill level and its target, in samples; once per packet or frame */
+void um_fb_update(struct um_fb *fb, int32_t fill_error);
+
+/* Feedback value, 16.16 samples per frame */
+uint32_t um_fb_value(struct um_fb *fb);
+
+/* Producer: value below 256 samples per frame (16.16) */
+void um_fb_post(struct um_fb_mailbox *mb, uint32_t value);
+
+/* Consumer: 1 and the newest value, if it has been posted since the last take; 0 otherwise */
+uint8_t um_fb_take(struct um_fb_mailbox *mb, uint32_t *value);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef __BENCH_STREAMS_H__
+#define __BENCH_STREAMS_H__
+
+/* Stream table of the host build of the benchmark (UM_STREAMS_CONFIG, see audio_buffer.h); firmware build takes
+ * Application/app/audio_streams.h. "out" and "in" have the geometry of the application streams, the rest give
+ * fast paths of the other CA modes */
+
+#define UM_STREAMS(OUT, IN) \
+    OUT(out, UM_BUFFER_CONFIG_CA_FEEDBACK, 192, 4, 1) \
+    OUT(out_none, UM_BUFFER_CONFIG_CA_NONE, 192, 4, 1) \
+    OUT(out_stretch, UM_BUFFER_CONFIG_CA_STRETCH, 192, 4, 1) \
+    OUT(out_asrc, UM_BUFFER_CONFIG_CA_ASRC, 192, 4, 1) \
+    IN(in, UM_BUFFER_CONFIG_CA_FEEDBACK, 384, 8, 1) \
+    IN(in_none, UM_BUFFER_CONFIG_CA_NONE, 384, 8, 1)
+
+#endif
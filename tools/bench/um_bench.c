@@ -0,0 +1,559 @@
+/*
+ * Cycle cost of the audio buffer engine (Application/usb/audio_buffer.c) hot paths.
+ *
+ * Every CA mode of both directions is run in steady state for several geometries:
+ * one packet is passed by USB side and one node is completed by DMA per iteration,
+ * so fill level stays at target. Off-target cases (op suffix _fill_high/_fill_low) hold
+ * fill one packet away from target, so stretch/squeeze, resampler steering and asynchronous
+ * IN packet sizing are active in every call. Fast paths of the streams of UM_STREAMS
+ * (um_handle_commit_<name>, um_handle_read_<name>) are timed against the generic call
+ * on the same geometry. Each call is timed on its own; results are CSV rows
+ * "op,dir,mode,packet,nodes,calls,unit,min,median,mean,max".
+ *
+ * Timer: DWT cycle counter on Cortex-M, TSC on x86 host, clock_gettime elsewhere.
+ * Host: make -C tools/bench && ./tools/bench/um_bench [-n calls] [-o file.csv]
+ * Target: make UM_BENCH=1; firmware prints the results over its console at start-up.
+ */
+#include "audio_buffer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__arm__)
+
+#define BENCH_MAX_CALLS             512
+#define BENCH_UNIT                  "cycles"
+
+#define BENCH_DEMCR                 (*(volatile uint32_t *)0xE000EDFCUL)
+#define BENCH_DWT_CTRL              (*(volatile uint32_t *)0xE0001000UL)
+#define BENCH_DWT_CYCCNT            (*(volatile uint32_t *)0xE0001004UL)
+
+static void bench_timer_init(void)
+{
+    BENCH_DEMCR |= (1UL << 24);     /* TRCENA */
+    BENCH_DWT_CYCCNT = 0;
+    BENCH_DWT_CTRL |= 1UL;          /* CYCCNTENA */
+}
+
+static inline uint32_t bench_now(void)
+{
+    return BENCH_DWT_CYCCNT;
+}
+
+#elif defined(__x86_64__) || defined(__i386__)
+
+#include <getopt.h>
+#include <x86intrin.h>
+
+#define BENCH_MAX_CALLS             (1 << 16)
+#define BENCH_UNIT                  "tsc"
+
+static void bench_timer_init(void)
+{
+}
+
+/* fences keep the call from being reordered around the reads */
+static inline uint32_t bench_now(void)
+{
+    uint32_t t;
+
+    _mm_lfence();
+    t = (uint32_t)__rdtsc();
+    _mm_lfence();
+    return t;
+}
+
+#else
+
+#include <getopt.h>
+#include <time.h>
+
+#define BENCH_MAX_CALLS             (1 << 16)
+#define BENCH_UNIT                  "ns"
+
+static void bench_timer_init(void)
+{
+}
+
+static inline uint32_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+#endif
+
+#define BENCH_OUT_SAMPLE_SIZE       4   /* 2 channels x 16 bit */
+#define BENCH_IN_SAMPLE_SIZE        8   /* 2 channels x 32 bit */
+#define BENCH_LISTENERS             4
+/* off-target fill keeps away from underrun and overflow only in rings of this many nodes */
+#define BENCH_OFF_TARGET_NODES      8
+
+struct bench_result
+{
+    uint32_t min;
+    uint32_t median;
+    uint32_t max;
+    double mean;
+};
+
+static const uint32_t packet_sizes[] = { 192, 384 };
+static const uint32_t node_counts[] = { 4, 8, 16 };
+static const uint8_t out_modes[] =
+{
+    UM_BUFFER_CONFIG_CA_NONE, UM_BUFFER_CONFIG_CA_STRETCH, UM_BUFFER_CONFIG_CA_FEEDBACK, UM_BUFFER_CONFIG_CA_ASRC
+};
+static const uint8_t in_modes[] = { UM_BUFFER_CONFIG_CA_NONE, UM_BUFFER_CONFIG_CA_FEEDBACK };
+/* fill is held at target, one packet above it, one packet below it */
+static const int8_t fill_offsets[] = { 0, 1, -1 };
+
+#ifdef UM_STREAMS
+struct bench_stream
+{
+    const char *name;
+    uint8_t dir;
+    uint8_t ca;
+    uint32_t packet_size;
+    uint32_t sample_size;
+    uint32_t frames_in_node;
+    int (*commit)(struct um_buffer_handle *handle, uint32_t bytes);
+    uint32_t (*read)(struct um_buffer_handle *handle, struct um_span span[2]);
+};
+
+#define BENCH_STREAM_OUT(name, ca, packet_size, sample_size, frames_in_node) \
+    { "commit_" #name, UM_BUFFER_CONFIG_DIR_OUT, ca, packet_size, sample_size, frames_in_node, um_handle_commit_##name, NULL },
+#define BENCH_STREAM_IN(name, ca, packet_size, sample_size, frames_in_node) \
+    { "read_" #name, UM_BUFFER_CONFIG_DIR_IN, ca, packet_size, sample_size, frames_in_node, NULL, um_handle_read_##name },
+
+static const struct bench_stream streams[] = { UM_STREAMS(BENCH_STREAM_OUT, BENCH_STREAM_IN) };
+#endif
+
+static struct um_buffer_handle handle;
+static uint8_t arena[UM_BUFFER_MEM_SIZE(384, 1, 16)] __attribute__((aligned(4)));
+static uint32_t usb_calls[BENCH_MAX_CALLS];
+static uint32_t dma_calls[BENCH_MAX_CALLS];
+static uint32_t calls = BENCH_MAX_CALLS;
+static FILE *out;
+static volatile uint32_t listener_sink;
+
+/* DMA is not running; position is the start of the node under hardware, as right after node switch */
+static void bench_play(uint32_t addr, uint32_t size)
+{
+    (void)addr;
+    (void)size;
+}
+
+static uint32_t bench_pause_resume(uint32_t cmd, uint32_t addr, uint32_t size)
+{
+    (void)cmd;
+    (void)addr;
+    (void)size;
+    return 0;
+}
+
+static void bench_next_node(uint32_t addr)
+{
+    (void)addr;
+}
+
+static uint32_t bench_position(void)
+{
+    return UM_ADDR(UM_CUR_NODE_FOR_HW(&handle)->um_buf);
+}
+
+static void bench_listener(void *args)
+{
+    listener_sink += *(uint32_t *)args;
+}
+
+static const char *ca_name(uint8_t ca)
+{
+    switch(ca)
+    {
+        case UM_BUFFER_CONFIG_CA_STRETCH:       return "stretch";
+        case UM_BUFFER_CONFIG_CA_FEEDBACK:      return "feedback";
+        case UM_BUFFER_CONFIG_CA_ASRC:          return "asrc";
+        default:                                return "none";
+    }
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Timer overhead (back to back reads) is subtracted from every call */
+static uint32_t timer_overhead(void)
+{
+    uint32_t i, t;
+
+    for(i = 0; i < calls; i++)
+    {
+        t = bench_now();
+        usb_calls[i] = bench_now() - t;
+    }
+
+    qsort(usb_calls, calls, sizeof(usb_calls[0]), compare_u32);
+    return usb_calls[0];
+}
+
+static void report(const char *op, int8_t off, uint8_t dir, uint8_t ca, uint32_t packet_size, uint32_t nodes,
+                   uint32_t *samples, uint32_t overhead)
+{
+    struct bench_result r;
+    uint64_t sum = 0;
+    uint32_t i;
+
+    for(i = 0; i < calls; i++)
+    {
+        samples[i] = samples[i] > overhead ? samples[i] - overhead : 0;
+        sum += samples[i];
+    }
+
+    qsort(samples, calls, sizeof(samples[0]), compare_u32);
+    r.min = samples[0];
+    r.median = samples[calls / 2];
+    r.max = samples[calls - 1];
+    r.mean = (double)sum / calls;
+
+    fprintf(out, "%s%s,%s,%s,%u,%u,%u,%s,%u,%u,%.1f,%u\n", op, off > 0 ? "_fill_high" : off < 0 ? "_fill_low" : "",
+        dir == UM_BUFFER_CONFIG_DIR_IN ? "in" : "out",
+        ca_name(ca), (unsigned)packet_size, (unsigned)nodes, (unsigned)calls, BENCH_UNIT,
+        (unsigned)r.min, (unsigned)r.median, r.mean, (unsigned)r.max);
+}
+
+static int bench_init(uint8_t dir, uint8_t ca, uint32_t packet_size, uint32_t sample_size, uint32_t frames_in_node,
+                      uint32_t nodes)
+{
+    int result;
+
+    memset(&handle, 0, sizeof(handle));
+    memset(arena, 0, sizeof(arena));
+
+    /* whole ring is in use, target is half of it */
+    result = um_handle_init(&handle, arena, sizeof(arena), packet_size, sample_size, frames_in_node, nodes, ca | dir,
+        bench_play, bench_pause_resume, bench_next_node);
+    if(result == UM_EOK)
+        um_handle_set_hw_position(&handle, bench_position);
+
+    return result;
+}
+
+static void register_listeners(uint32_t ids[2][BENCH_LISTENERS])
+{
+    uint32_t i;
+
+    for(i = 0; i < BENCH_LISTENERS; i++)
+    {
+        ids[0][i] = um_handle_register_listener(&handle, UM_LISTENER_TYPE_CA, bench_listener);
+        ids[1][i] = um_handle_register_watermark(&handle, (uint8_t)(20 + (20 * i)), 10, 0, bench_listener);
+    }
+}
+
+static void unregister_listeners(uint32_t ids[2][BENCH_LISTENERS])
+{
+    uint32_t i;
+
+    for(i = 0; i < BENCH_LISTENERS; i++)
+    {
+        um_handle_unregister_listener(&handle, UM_LISTENER_TYPE_CA, ids[0][i]);
+        um_handle_unregister_listener(&handle, UM_LISTENER_TYPE_WATERMARK, ids[1][i]);
+    }
+}
+
+/* Off-target fill: an extra packet or node completion (not timed) puts fill back, once CA has corrected it
+ * to less than a packet away from target. Timed calls see one packet more than now: OUT packet is passed
+ * by them, IN node is completed right before them */
+static void hold_fill(int8_t off, uint32_t packet_size)
+{
+    int32_t error = (int32_t)um_handle_get_fill_bytes(&handle) + (int32_t)packet_size - (int32_t)handle.um_target_fill;
+    uint8_t in = GET_CONFIG_DIR(handle.um_buffer_config) == UM_BUFFER_CONFIG_DIR_IN;
+    struct um_span span[2];
+
+    if(off > 0 && error < (int32_t)packet_size)
+    {
+        if(in)
+            audio_dma_complete_cb(&handle);
+        else
+            um_handle_enqueue(&handle, (uint16_t)packet_size);
+    }
+    else if(off < 0 && error > -(int32_t)packet_size)
+    {
+        if(in)
+            um_handle_read(&handle, span);
+        else
+            audio_dma_complete_cb(&handle);
+    }
+}
+
+/* OUT: hardware start; one node is played ahead, so fill is at target right after each packet and CA stays idle */
+static void prime_out(uint32_t packet_size)
+{
+    while(handle.um_buffer_state != UM_BUFFER_STATE_PLAY)
+        um_handle_enqueue(&handle, (uint16_t)packet_size);
+    audio_dma_complete_cb(&handle);
+}
+
+/* IN: hardware start and preroll, until capture has filled target latency */
+static void prime_in(uint32_t nodes)
+{
+    struct um_span span[2];
+    uint32_t i;
+
+    um_handle_read(&handle, span);
+    for(i = 0; i < nodes; i++)
+    {
+        audio_dma_complete_cb(&handle);
+        um_handle_read(&handle, span);
+    }
+}
+
+/* OUT: enqueue of one packet, then completion of the node it is in */
+static void bench_out(uint8_t ca, uint32_t packet_size, uint32_t nodes, uint8_t listeners, int8_t off, uint32_t overhead)
+{
+    uint32_t ids[2][BENCH_LISTENERS];
+    uint32_t i, t;
+
+    if(bench_init(UM_BUFFER_CONFIG_DIR_OUT, ca, packet_size, BENCH_OUT_SAMPLE_SIZE, 1, nodes) != UM_EOK)
+        return;
+
+    if(listeners)
+        register_listeners(ids);
+
+    prime_out(packet_size);
+
+    for(i = 0; i < calls; i++)
+    {
+        hold_fill(off, packet_size);
+
+        t = bench_now();
+        um_handle_enqueue(&handle, (uint16_t)packet_size);
+        usb_calls[i] = bench_now() - t;
+
+        t = bench_now();
+        audio_dma_complete_cb(&handle);
+        dma_calls[i] = bench_now() - t;
+    }
+
+    if(listeners)
+    {
+        unregister_listeners(ids);
+        report("enqueue_listeners", off, UM_BUFFER_CONFIG_DIR_OUT, ca, packet_size, nodes, usb_calls, overhead);
+        return;
+    }
+
+    report("enqueue", off, UM_BUFFER_CONFIG_DIR_OUT, ca, packet_size, nodes, usb_calls, overhead);
+    report("dma_complete", off, UM_BUFFER_CONFIG_DIR_OUT, ca, packet_size, nodes, dma_calls, overhead);
+}
+
+/* IN: completion of one captured node, then the packet taken from it;
+ * dequeue serves fixed packets of CA_NONE, asynchronous packets of CA_FEEDBACK are read as spans */
+static void bench_in(uint8_t ca, uint32_t packet_size, uint32_t nodes, uint8_t listeners, int8_t off, uint32_t overhead)
+{
+    uint32_t ids[2][BENCH_LISTENERS];
+    struct um_span span[2];
+    uint32_t i, t;
+
+    if(bench_init(UM_BUFFER_CONFIG_DIR_IN, ca, packet_size, BENCH_IN_SAMPLE_SIZE, 1, nodes) != UM_EOK)
+        return;
+
+    if(listeners)
+        register_listeners(ids);
+
+    prime_in(nodes);
+
+    for(i = 0; i < calls; i++)
+    {
+        hold_fill(off, packet_size);
+
+        t = bench_now();
+        audio_dma_complete_cb(&handle);
+        dma_calls[i] = bench_now() - t;
+
+        t = bench_now();
+        if(ca == UM_BUFFER_CONFIG_CA_NONE)
+            um_handle_dequeue(&handle, (uint16_t)packet_size);
+        else
+            um_handle_read(&handle, span);
+        usb_calls[i] = bench_now() - t;
+    }
+
+    if(listeners)
+    {
+        unregister_listeners(ids);
+        report(ca == UM_BUFFER_CONFIG_CA_NONE ? "dequeue_listeners" : "read_listeners", off,
+            UM_BUFFER_CONFIG_DIR_IN, ca, packet_size, nodes, usb_calls, overhead);
+        return;
+    }
+
+    report(ca == UM_BUFFER_CONFIG_CA_NONE ? "dequeue" : "read", off, UM_BUFFER_CONFIG_DIR_IN, ca, packet_size, nodes, usb_calls, overhead);
+    report("dma_complete", off, UM_BUFFER_CONFIG_DIR_IN, ca, packet_size, nodes, dma_calls, overhead);
+}
+
+#ifdef UM_STREAMS
+/* Fast path of the stream (fast != 0) or generic commit/read on its geometry, both called through a pointer;
+ * OUT packet is reserved before and its node completed after the timed commit, IN node is completed before the read */
+static void bench_stream(const struct bench_stream *s, uint32_t nodes, uint8_t fast, int8_t off, uint32_t overhead)
+{
+    int (*commit_call)(struct um_buffer_handle *, uint32_t) = fast ? s->commit : um_handle_commit;
+    uint32_t (*read_call)(struct um_buffer_handle *, struct um_span *) = fast ? s->read : um_handle_read;
+    struct um_span span[2];
+    uint32_t i, t;
+
+    if(bench_init(s->dir, s->ca, s->packet_size, s->sample_size, s->frames_in_node, nodes) != UM_EOK)
+        return;
+
+    if(s->dir == UM_BUFFER_CONFIG_DIR_OUT)
+        prime_out(s->packet_size);
+    else
+        prime_in(nodes);
+
+    for(i = 0; i < calls; i++)
+    {
+        hold_fill(off, s->packet_size);
+
+        if(s->dir == UM_BUFFER_CONFIG_DIR_OUT)
+        {
+            um_handle_reserve(&handle, s->packet_size, span);
+
+            t = bench_now();
+            commit_call(&handle, s->packet_size);
+            usb_calls[i] = bench_now() - t;
+
+            if((i % s->frames_in_node) == s->frames_in_node - 1)
+                audio_dma_complete_cb(&handle);
+        }
+        else
+        {
+            if((i % s->frames_in_node) == 0)
+                audio_dma_complete_cb(&handle);
+
+            t = bench_now();
+            read_call(&handle, span);
+            usb_calls[i] = bench_now() - t;
+        }
+    }
+
+    report(fast ? s->name : (s->dir == UM_BUFFER_CONFIG_DIR_OUT ? "commit" : "read"), off, s->dir, s->ca,
+        s->packet_size, nodes, usb_calls, overhead);
+}
+#endif
+
+void um_bench_run(void)
+{
+    uint32_t overhead, p, n, m, l, o;
+
+    bench_timer_init();
+    overhead = timer_overhead();
+
+    if(out == NULL)
+        out = stdout;
+
+    fprintf(out, "op,dir,mode,packet,nodes,calls,unit,min,median,mean,max\n");
+
+    for(p = 0; p < sizeof(packet_sizes) / sizeof(packet_sizes[0]); p++)
+    {
+        for(n = 0; n < sizeof(node_counts) / sizeof(node_counts[0]); n++)
+        {
+            for(l = 0; l < 2; l++)
+            {
+                for(m = 0; m < sizeof(out_modes); m++)
+                    bench_out(out_modes[m], packet_sizes[p], node_counts[n], (uint8_t)l, 0, overhead);
+
+                for(m = 0; m < sizeof(in_modes); m++)
+                    bench_in(in_modes[m], packet_sizes[p], node_counts[n], (uint8_t)l, 0, overhead);
+            }
+
+            if(node_counts[n] < BENCH_OFF_TARGET_NODES)
+                continue;
+
+            for(o = 1; o < sizeof(fill_offsets); o++)
+            {
+                for(m = 0; m < sizeof(out_modes); m++)
+                    bench_out(out_modes[m], packet_sizes[p], node_counts[n], 0, fill_offsets[o], overhead);
+
+                for(m = 0; m < sizeof(in_modes); m++)
+                    bench_in(in_modes[m], packet_sizes[p], node_counts[n], 0, fill_offsets[o], overhead);
+            }
+        }
+    }
+
+#ifdef UM_STREAMS
+    for(m = 0; m < sizeof(streams) / sizeof(streams[0]); m++)
+    {
+        for(n = 0; n < sizeof(node_counts) / sizeof(node_counts[0]); n++)
+        {
+            for(o = 0; o < sizeof(fill_offsets); o++)
+            {
+                if(fill_offsets[o] != 0 && node_counts[n] < BENCH_OFF_TARGET_NODES)
+                    continue;
+
+                bench_stream(&streams[m], node_counts[n], 0, fill_offsets[o], overhead);
+                bench_stream(&streams[m], node_counts[n], 1, fill_offsets[o], overhead);
+            }
+        }
+    }
+#endif
+
+    fflush(out);
+}
+
+#if !defined(__arm__)
+
+static void usage(const char *name)
+{
+    printf("usage: %s [options]\n"
+           "  -n, --calls N     timed calls per case, up to %u (default %u)\n"
+           "  -o, --output F    CSV file instead of stdout\n",
+           name, (unsigned)BENCH_MAX_CALLS, (unsigned)BENCH_MAX_CALLS);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] =
+    {
+        { "calls",  required_argument, NULL, 'n' },
+        { "output", required_argument, NULL, 'o' },
+        { "help",   no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+
+    while((opt = getopt_long(argc, argv, "n:o:h", options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'n':
+                calls = (uint32_t)atoi(optarg);
+                if(calls == 0 || calls > BENCH_MAX_CALLS)
+                    calls = BENCH_MAX_CALLS;
+            break;
+            case 'o':
+                out = fopen(optarg, "w");
+                if(out == NULL)
+                {
+                    perror(optarg);
+                    return 1;
+                }
+            break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    um_bench_run();
+
+    if(out != stdout)
+        fclose(out);
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,164 @@
+/*
+ * Throughput of the audio buffer engine before and after the static index-based ring.
+ *
+ * The same loop is built against the malloc'd node list engine, the first static ring or the current
+ * tree; the engine is told apart by its header, sources of a revision are taken from git by
+ * "make compare". One packet is passed by USB side per iteration and DMA completes one node per
+ * node of packets, with one CA listener registered.
+ * Result is the mean cost of packet and its share of DMA completion, in TSC ticks on x86 host
+ * (nanoseconds elsewhere), over the whole run; it is not split into single calls as um_bench does.
+ *
+ * make -C tools/bench compare [BEFORE=<commit>] [AFTER=<commit>] [PACKETS=<count>]
+ */
+#include "audio_buffer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <x86intrin.h>
+
+#define BENCH_UNIT                  "tsc"
+
+static inline uint64_t bench_now(void)
+{
+    return __rdtsc();
+}
+
+#else
+
+#include <time.h>
+
+#define BENCH_UNIT                  "ns"
+
+static inline uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif
+
+#define BENCH_PACKETS               20000000L
+#define BENCH_SAMPLE_SIZE           4   /* 2 channels x 16 bit */
+#define BENCH_FRAMES_IN_NODE        4
+#define BENCH_NODES                 4
+
+struct ring_case
+{
+    const char *name;
+    uint8_t ca;
+    uint8_t in;
+    uint32_t packet_size;
+};
+
+static const struct ring_case cases[] =
+{
+    { "out feedback enqueue",   UM_BUFFER_CONFIG_CA_FEEDBACK,   0, 192 },
+    { "out none enqueue",       UM_BUFFER_CONFIG_CA_NONE,       0, 192 },
+    { "in none dequeue",        UM_BUFFER_CONFIG_CA_NONE,       1, 384 },
+};
+
+static struct um_buffer_handle handle;
+static volatile uint32_t listener_sink;
+
+/* node list engine allocates nodes on its own; static ring gets memory block of UM_BUFFER_MEM_SIZE */
+#ifdef UM_BUFFER_MEM_SIZE
+static uint8_t arena[UM_BUFFER_MEM_SIZE(384, BENCH_FRAMES_IN_NODE, BENCH_NODES)] __attribute__((aligned(4)));
+#endif
+
+static void bench_play(uint32_t addr, uint32_t size)
+{
+    (void)addr;
+    (void)size;
+}
+
+static uint32_t bench_pause_resume(uint32_t cmd, uint32_t addr, uint32_t size)
+{
+    (void)cmd;
+    (void)addr;
+    (void)size;
+    return 0;
+}
+
+#ifdef UM_BUFFER_CONFIG_DIR_IN
+static void bench_next_node(uint32_t addr)
+{
+    (void)addr;
+}
+#endif
+
+static void bench_listener(void *args)
+{
+    listener_sink += *(uint32_t *)args;
+}
+
+/* Ring of BENCH_NODES nodes of BENCH_FRAMES_IN_NODE packets; only current engine knows direction */
+static int ring_init(const struct ring_case *c)
+{
+#if !defined(UM_BUFFER_MEM_SIZE)
+    return um_handle_init(&handle, c->packet_size, BENCH_FRAMES_IN_NODE, BENCH_NODES, c->ca,
+        bench_play, bench_pause_resume);
+#elif !defined(UM_BUFFER_CONFIG_DIR_IN)
+    return um_handle_init(&handle, arena, sizeof(arena), c->packet_size, BENCH_FRAMES_IN_NODE, BENCH_NODES, c->ca,
+        bench_play, bench_pause_resume);
+#else
+    return um_handle_init(&handle, arena, sizeof(arena), c->packet_size, BENCH_SAMPLE_SIZE,
+        BENCH_FRAMES_IN_NODE, BENCH_NODES, c->ca | (c->in ? UM_BUFFER_CONFIG_DIR_IN : UM_BUFFER_CONFIG_DIR_OUT),
+        bench_play, bench_pause_resume, bench_next_node);
+#endif
+}
+
+static void run(const struct ring_case *c, long packets)
+{
+    uint32_t id;
+    uint64_t start;
+    long i, dropped = 0;
+
+    if(ring_init(c) != UM_EOK)
+    {
+        printf("%-24s init failed\n", c->name);
+        return;
+    }
+
+    id = um_handle_register_listener(&handle, UM_LISTENER_TYPE_CA, bench_listener);
+
+    start = bench_now();
+    for(i = 0; i < packets; i++)
+    {
+        uint8_t *next = c->in ?
+            um_handle_dequeue(&handle, (uint16_t)c->packet_size) :
+            um_handle_enqueue(&handle, (uint16_t)c->packet_size);
+
+        dropped += next == NULL;
+
+        /* hardware is started with half of the ring; it completes a node per node of packets */
+        if(i >= (BENCH_FRAMES_IN_NODE * BENCH_NODES) / 2 && (i % BENCH_FRAMES_IN_NODE) == BENCH_FRAMES_IN_NODE - 1)
+            audio_dma_complete_cb(&handle);
+    }
+
+    printf("%-24s %6.1f %s/packet, %ld dropped\n", c->name, (double)(bench_now() - start) / packets, BENCH_UNIT, dropped);
+
+    um_handle_unregister_listener(&handle, UM_LISTENER_TYPE_CA, id);
+}
+
+int main(int argc, char **argv)
+{
+    long packets = argc > 1 ? atol(argv[1]) : BENCH_PACKETS;
+    uint32_t i;
+
+    if(packets <= 0)
+    {
+        printf("usage: %s [packets]\n", argv[0]);
+        return 1;
+    }
+
+    for(i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        run(&cases[i], packets);
+
+    return 0;
+}
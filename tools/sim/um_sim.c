@@ -0,0 +1,795 @@
+/*
+ * Discrete-event simulator of the audio buffer engine (Application/usb/audio_buffer.c).
+ *
+ * USB host is the time reference: frames come every 1 ms, each packet is handled by the
+ * device with random delay (jitter) and may be lost. Codec/ADC runs from its own clock,
+ * which is off by the given ppm; DMA completes one node per transfer and is re-pointed
+ * to the next node exactly as on the target.
+ */
+#include "audio_buffer.h"
+#include "audio_feedback.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIM_NS_IN_FRAME             1000000LL
+#define SIM_NS_NEVER                INT64_MAX
+#define SIM_SAMPLE_RATE             48000.0
+#define SIM_SAMPLES_IN_FRAME        48
+
+#define SIM_OUT_SAMPLE_SIZE         4   /* 2 channels x 16 bit */
+#define SIM_IN_SAMPLE_SIZE          8   /* 2 channels x 32 bit */
+
+#define SIM_HIST_BIN_US             250
+#define SIM_HIST_BINS               128
+
+/* stm32_audio_feedback_driver: MCLK = 256 * Fs is counted between SOFs */
+#define SIM_FB_MCLK_SHIFT           8
+
+
+struct sim_config
+{
+    uint8_t dir;
+    uint8_t ca;
+    /* IN: ADC trigger timer is reset by SOF, so capture runs at host rate whatever ppm is */
+    uint8_t adc_sof_lock;
+    /* IN: ADC rate is dithered between timer periods and follows capture fill level */
+    uint8_t adc_fractional;
+    double ppm;
+    uint32_t jitter_us;
+    double miss_prob;
+    double seconds;
+    uint32_t latency_us;
+    uint32_t nodes;
+    uint32_t frames_in_node;
+    uint32_t fb_interval;
+    /* OUT feedback from fill level only (FBCK_SOURCE_FILL), no MCLK capture */
+    uint8_t fb_fill;
+    uint32_t seed;
+    /* streaming interface is in alt 0 for idle_ms at the start of every second */
+    uint32_t idle_ms;
+    uint8_t cold_idle;
+    /* IN: um_handle_set_settle_time */
+    uint32_t settle_us;
+    /* node count is switched between nodes and nodes / 2 with um_handle_reconfigure in the middle of every second */
+    uint8_t reconfigure;
+    /* OUT: packets are received straight into the ring (UM_OUT_ZERO_COPY of Application/app/main.c) */
+    uint8_t zero_copy;
+};
+
+struct sim_dma
+{
+    uint8_t running;
+    uint8_t paused;
+    uint8_t ct;
+    uint32_t target[2];
+    uint32_t size;
+    double ns_per_byte;
+    int64_t start;
+    int64_t next;
+    int64_t remaining;
+};
+
+struct sim_stats
+{
+    uint64_t frames;
+    uint64_t packets;
+    uint64_t lost;
+    uint64_t underruns;
+    uint64_t overruns;
+    uint64_t ca_activations;
+    uint64_t hw_starts;
+    /* IN packets sent without captured data: preroll after hardware start */
+    uint64_t silent_packets;
+    /* IN: frames from stream start (alt 1) to the first packet of captured data */
+    uint64_t streams;
+    uint64_t clean_frames_sum;
+    uint64_t clean_frames_max;
+    /* IN: asynchronous packets one frame longer and shorter than nominal */
+    uint64_t long_packets;
+    uint64_t short_packets;
+    /* reconfigurations and the longest time from one to hardware start */
+    uint64_t reconfigs;
+    int64_t reconfig_at;
+    int64_t reconfig_gap_max;
+    /* time hardware has not played stream data: paused after xrun or playing conceal node */
+    int64_t dropout_ns;
+    int64_t paused_at;
+    /* OUT zero copy: packets received into the drop buffer, since rx window was too short when endpoint was armed */
+    uint64_t rx_drops;
+
+    uint64_t hist[SIM_HIST_BINS];
+    uint64_t lat_samples;
+    uint64_t lat_sum;
+    uint32_t lat_min;
+    uint32_t lat_max;
+};
+
+static const struct sim_config *cfg;
+static struct um_buffer_handle handle;
+static uint8_t *arena;
+static uint32_t sample_size;
+static uint32_t packet_size;
+
+static int64_t now;
+static uint8_t stopping;
+static struct sim_dma dma;
+static struct sim_stats stats;
+static uint32_t rnd_state;
+
+/* IN: frame of the last stream start, while its first captured packet has not been sent yet */
+static uint64_t stream_start;
+static uint8_t waiting_clean;
+
+/* device clock */
+static double dev_rate;
+
+/* adc driver state: fill level loop and the rate it sets, samples per frame */
+static struct um_fb adc_rate;
+static double adc_samples_in_frame;
+
+/* feedback driver state */
+static struct um_fb fb;
+static double fb_mclk_phase;
+static double fb_samples_in_frame;
+static double host_sample_acc;
+
+/* endpoint OUT is armed on the ring (zero copy) */
+static uint8_t rx_armed;
+
+static uint32_t sim_rand(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+static double sim_rand_unit(void)
+{
+    return (double)sim_rand() / 4294967296.0;
+}
+
+static void update_dev_rate(void)
+{
+    double clock_error = 1.0 + (cfg->ppm * 1e-6);
+
+    if(cfg->dir == UM_BUFFER_CONFIG_DIR_IN && cfg->adc_sof_lock)
+        dev_rate = SIM_SAMPLE_RATE;
+    else if(cfg->dir == UM_BUFFER_CONFIG_DIR_IN && cfg->adc_fractional)
+        dev_rate = (SIM_SAMPLE_RATE * clock_error * adc_samples_in_frame) / SIM_SAMPLES_IN_FRAME;
+    else
+        dev_rate = SIM_SAMPLE_RATE * clock_error;
+
+    dma.ns_per_byte = 1e9 / (dev_rate * sample_size);
+}
+
+/*=====================================================================*/
+/*=================== HARDWARE CALLBACKS OF ENGINE ====================*/
+/*=====================================================================*/
+
+static void sim_play(uint32_t addr, uint32_t size)
+{
+    if(stats.reconfig_at)
+    {
+        stats.reconfig_gap_max = now - stats.reconfig_at > stats.reconfig_gap_max ? now - stats.reconfig_at : stats.reconfig_gap_max;
+        stats.reconfig_at = 0;
+    }
+
+    dma.target[0] = addr;
+    dma.target[1] = addr + size;
+    dma.ct = 0;
+    dma.size = size;
+    dma.running = 1;
+    dma.paused = 0;
+    dma.start = now;
+    dma.next = now + (int64_t)(size * dma.ns_per_byte);
+
+    stats.hw_starts++;
+}
+
+static uint32_t sim_pause_resume(uint32_t cmd, uint32_t addr, uint32_t size)
+{
+    (void)addr;
+    (void)size;
+
+    if(cmd == 0)
+    {
+        if(dma.running && !dma.paused)
+        {
+            dma.paused = 1;
+            dma.remaining = dma.next - now;
+        }
+
+        /* engine stops hardware only on xrun, when stream is idle or when handle is freed */
+        if(stopping)
+        {
+            stats.paused_at = 0;
+            return 0;
+        }
+
+        if(cfg->dir == UM_BUFFER_CONFIG_DIR_IN)
+            stats.overruns++;
+        else
+            stats.underruns++;
+
+        stats.paused_at = now;
+    }
+    else if(dma.paused)
+    {
+        if(stats.paused_at)
+            stats.dropout_ns += now - stats.paused_at;
+        stats.hw_starts++;
+        dma.paused = 0;
+        dma.next = now + dma.remaining;
+        dma.start = dma.next - (int64_t)(dma.size * dma.ns_per_byte);
+    }
+    return 0;
+}
+
+static void sim_next_node(uint32_t addr)
+{
+    dma.target[dma.ct ^ 1] = addr;
+}
+
+static uint32_t sim_position(void)
+{
+    int64_t elapsed;
+    uint32_t progress;
+
+    if(!dma.running)
+        return dma.target[0];
+
+    elapsed = dma.paused ? (dma.next - dma.remaining - dma.start) : (now - dma.start);
+    progress = (uint32_t)(elapsed / dma.ns_per_byte);
+    progress -= progress % sample_size;
+
+    return dma.target[dma.ct] + (progress < dma.size ? progress : dma.size - sample_size);
+}
+
+static void sim_dma_complete(void)
+{
+    dma.ct ^= 1;
+    dma.start = dma.next;
+    update_dev_rate();
+    dma.next = dma.start + (int64_t)(dma.size * dma.ns_per_byte);
+
+    if(dma.target[dma.ct] == UM_ADDR(handle.um_conceal_node))
+        stats.dropout_ns += dma.next - dma.start;
+
+    audio_dma_complete_cb(&handle);
+}
+
+/*=====================================================================*/
+/*============================ USB HOST ===============================*/
+/*=====================================================================*/
+
+/* TIM2 counts MCLK between SOFs, one capture per frame */
+static void capture_frame(void)
+{
+    double mclk = ((1 << SIM_FB_MCLK_SHIFT) * dev_rate) / 1000.0 + fb_mclk_phase;
+    uint32_t count = (uint32_t)mclk;
+
+    fb_mclk_phase = mclk - count;
+    um_fb_add_frames(&fb, &count, 1);
+}
+
+/* tud_sof_cb of Application/app/main.c with FBCK_SOURCE_FILL: packet of this frame is not in yet */
+static void sample_fill(void)
+{
+    if(handle.um_buffer_state == UM_BUFFER_STATE_PLAY && !handle.um_standby)
+        um_fb_update(&fb, (int32_t)(um_handle_get_fill_samples(&handle) + SIM_SAMPLES_IN_FRAME) - (int32_t)(handle.um_target_fill / sample_size));
+}
+
+/* Driver sends new value every fb_interval frames */
+static void update_feedback(void)
+{
+    fb_samples_in_frame = (double)um_fb_value(&fb) / UM_FB_ONE_SAMPLE;
+}
+
+/* audio_out_arm_rx of Application/app/main.c: next packet goes to the ring, if window holds the largest packet of alt setting */
+static void arm_rx(void)
+{
+    uint32_t offset;
+
+    rx_armed = um_handle_get_rx_window(&handle, &offset) >= packet_size + sample_size;
+}
+
+static void sample_latency(void)
+{
+    uint32_t fill_us;
+
+    if(handle.um_buffer_state != UM_BUFFER_STATE_PLAY)
+        return;
+
+    fill_us = (um_handle_get_fill_bytes(&handle) * 1000) / packet_size;
+
+    stats.hist[fill_us / SIM_HIST_BIN_US < SIM_HIST_BINS ? fill_us / SIM_HIST_BIN_US : SIM_HIST_BINS - 1]++;
+    stats.lat_samples++;
+    stats.lat_sum += fill_us;
+    stats.lat_min = fill_us < stats.lat_min ? fill_us : stats.lat_min;
+    stats.lat_max = fill_us > stats.lat_max ? fill_us : stats.lat_max;
+}
+
+static void usb_out_packet(void)
+{
+    uint32_t samples = SIM_SAMPLES_IN_FRAME;
+    uint8_t ca_before = GET_CONGESTION_AVOIDANCE_FLAG(handle.um_buffer_flags);
+    struct um_span span[2];
+
+    if(cfg->ca == UM_BUFFER_CONFIG_CA_FEEDBACK)
+    {
+        host_sample_acc += fb_samples_in_frame;
+        samples = (uint32_t)host_sample_acc;
+
+        /* host never exceeds max packet size */
+        if(samples > SIM_SAMPLES_IN_FRAME + 1) samples = SIM_SAMPLES_IN_FRAME + 1;
+        if(samples < SIM_SAMPLES_IN_FRAME - 1) samples = SIM_SAMPLES_IN_FRAME - 1;
+        host_sample_acc -= samples;
+    }
+
+    if(cfg->zero_copy)
+    {
+        /* packet is in the ring already, if endpoint has been armed on it; engine accounts for it or drops it */
+        if(!rx_armed)
+            stats.rx_drops++;
+        else if(um_handle_commit(&handle, samples * sample_size) != UM_EOK)
+            stats.overruns++;
+
+        arm_rx();
+    }
+    /* packet is dropped, if there is no room for it */
+    else if(um_handle_reserve(&handle, samples * sample_size, span) == 0 ||
+            um_handle_commit(&handle, samples * sample_size) != UM_EOK)
+    {
+        stats.overruns++;
+    }
+
+    /* FBCK_update_fill of Application/app/main.c */
+    if(cfg->ca == UM_BUFFER_CONFIG_CA_FEEDBACK && !cfg->fb_fill && handle.um_buffer_state == UM_BUFFER_STATE_PLAY && !handle.um_standby)
+        um_fb_update(&fb, (int32_t)um_handle_get_fill_samples(&handle) - (int32_t)(handle.um_target_fill / sample_size));
+
+    if(!ca_before && GET_CONGESTION_AVOIDANCE_FLAG(handle.um_buffer_flags))
+        stats.ca_activations++;
+}
+
+/* Analog_MIC_update_fill of Application/app/main.c; sigma-delta of the driver keeps the average period exact */
+static void adc_update_fill(void)
+{
+    if(handle.um_buffer_state != UM_BUFFER_STATE_PLAY || handle.um_standby)
+        return;
+
+    um_fb_update(&adc_rate, (int32_t)um_handle_get_fill_samples(&handle) - (int32_t)(handle.um_target_fill / sample_size));
+    adc_samples_in_frame = (double)um_fb_value(&adc_rate) / UM_FB_ONE_SAMPLE;
+    update_dev_rate();
+}
+
+static void usb_in_packet(uint64_t frame)
+{
+    struct um_span span[2];
+    uint32_t count = um_handle_read(&handle, span);
+    uint32_t size;
+
+    if(cfg->adc_fractional)
+        adc_update_fill();
+
+    if(count == 0)
+    {
+        stats.underruns++;
+        return;
+    }
+
+    size = span[0].size + (count > 1 ? span[1].size : 0);
+    stats.long_packets += size > packet_size;
+    stats.short_packets += size < packet_size;
+
+    /* silent node is given during preroll and settle time */
+    if(span[0].ptr == handle.um_conceal_node)
+    {
+        stats.silent_packets++;
+        return;
+    }
+
+    if(waiting_clean)
+    {
+        uint64_t frames = frame - stream_start + 1;
+
+        stats.streams++;
+        stats.clean_frames_sum += frames;
+        stats.clean_frames_max = frames > stats.clean_frames_max ? frames : stats.clean_frames_max;
+        waiting_clean = 0;
+    }
+}
+
+static void usb_frame(uint64_t frame)
+{
+    stats.frames++;
+
+    if(cfg->idle_ms && (frame % 1000) < cfg->idle_ms)
+    {
+        /* host has switched interface to alt 0 */
+        if((frame % 1000) == 0 && handle.um_buffer_state == UM_BUFFER_STATE_PLAY)
+        {
+            if(cfg->cold_idle)
+            {
+                stopping = 1;
+                um_handle_pause(&handle);
+                stopping = 0;
+            }
+            else
+            {
+                um_handle_standby(&handle);
+            }
+
+            /* endpoint is not armed in alt 0, so ring is free to be reset */
+            if(cfg->zero_copy)
+                arm_rx();
+        }
+        return;
+    }
+
+    if(cfg->reconfigure && (frame % 1000) == 500)
+    {
+        uint32_t nodes = handle.um_node_capacity == cfg->nodes ? cfg->nodes >> 1 : cfg->nodes;
+
+        stopping = 1;
+        if(um_handle_reconfigure(&handle, packet_size, sample_size, cfg->frames_in_node, nodes, cfg->ca | cfg->dir) == UM_EOK)
+        {
+            stats.reconfigs++;
+            stats.reconfig_at = now;
+        }
+        stopping = 0;
+        if(cfg->zero_copy)
+            arm_rx();
+    }
+
+    /* host has switched interface to alt 1 */
+    if(frame == 0 || (cfg->idle_ms && (frame % 1000) == cfg->idle_ms))
+    {
+        stream_start = frame;
+        waiting_clean = 1;
+
+        /* capture is started by interface switch as main.c does, not by the first packet */
+        if(cfg->dir == UM_BUFFER_CONFIG_DIR_IN)
+            um_handle_start(&handle);
+    }
+
+    if(cfg->dir == UM_BUFFER_CONFIG_DIR_OUT && cfg->ca == UM_BUFFER_CONFIG_CA_FEEDBACK)
+    {
+        /* fill level is sampled at SOF instead */
+        if(cfg->fb_fill)
+            sample_fill();
+        else
+            capture_frame();
+
+        if((frame % cfg->fb_interval) == 0)
+            update_feedback();
+    }
+
+    if(sim_rand_unit() < cfg->miss_prob)
+    {
+        stats.lost++;
+        return;
+    }
+
+    if(cfg->dir == UM_BUFFER_CONFIG_DIR_OUT)
+        usb_out_packet();
+    else
+        usb_in_packet(frame);
+
+    stats.packets++;
+    sample_latency();
+}
+
+static int64_t usb_frame_time(uint64_t frame)
+{
+    int64_t t = (int64_t)frame * SIM_NS_IN_FRAME;
+
+    if(cfg->jitter_us)
+        t += (int64_t)(sim_rand() % (cfg->jitter_us * 1000));
+
+    return t;
+}
+
+/*=====================================================================*/
+/*============================== RUN ==================================*/
+/*=====================================================================*/
+
+static int sim_run(const struct sim_config *config)
+{
+    uint32_t mem_size;
+    uint64_t frame = 0;
+    int64_t end, next_usb;
+    int result;
+
+    cfg = config;
+    memset(&stats, 0, sizeof(stats));
+    memset(&dma, 0, sizeof(dma));
+    stats.lat_min = UINT32_MAX;
+    rnd_state = cfg->seed ? cfg->seed : 1;
+    now = 0;
+    stopping = 0;
+
+    sample_size = cfg->dir == UM_BUFFER_CONFIG_DIR_IN ? SIM_IN_SAMPLE_SIZE : SIM_OUT_SAMPLE_SIZE;
+    packet_size = sample_size * SIM_SAMPLES_IN_FRAME;
+
+    if(cfg->fb_fill)
+        um_fb_init_fill(&fb, SIM_SAMPLES_IN_FRAME * UM_FB_ONE_SAMPLE);
+    else
+        um_fb_init(&fb, SIM_SAMPLES_IN_FRAME * UM_FB_ONE_SAMPLE, SIM_FB_MCLK_SHIFT);
+    fb_mclk_phase = 0;
+    host_sample_acc = 0;
+    um_fb_init_fill(&adc_rate, SIM_SAMPLES_IN_FRAME * UM_FB_ONE_SAMPLE);
+    adc_samples_in_frame = SIM_SAMPLES_IN_FRAME;
+    update_dev_rate();
+    fb_samples_in_frame = SIM_SAMPLES_IN_FRAME;
+
+    mem_size = UM_BUFFER_MEM_SIZE(packet_size, cfg->frames_in_node, cfg->nodes);
+    arena = calloc(1, mem_size);
+    if(arena == NULL)
+        return UM_ENOMEM;
+
+    result = um_handle_init(&handle, arena, mem_size, packet_size, sample_size,
+        cfg->frames_in_node, cfg->nodes, cfg->ca | cfg->dir,
+        sim_play, sim_pause_resume, sim_next_node);
+    if(result == UM_EOK && cfg->latency_us)
+        result = um_handle_set_target_latency(&handle, cfg->latency_us);
+    if(result == UM_EOK && cfg->settle_us)
+        result = um_handle_set_settle_time(&handle, cfg->settle_us);
+    if(result != UM_EOK)
+    {
+        free(arena);
+        return result;
+    }
+
+    um_handle_set_hw_position(&handle, sim_position);
+
+    /* endpoint is armed before host selects alt 1 */
+    if(cfg->zero_copy)
+        arm_rx();
+
+    end = (int64_t)(cfg->seconds * 1e9);
+    next_usb = usb_frame_time(0);
+
+    while(1)
+    {
+        int64_t next_dma = (dma.running && !dma.paused) ? dma.next : SIM_NS_NEVER;
+
+        if(next_usb <= next_dma)
+        {
+            now = next_usb;
+            if(now > end)
+                break;
+
+            usb_frame(frame++);
+
+            /* device handles packets in order */
+            next_usb = usb_frame_time(frame);
+            next_usb = next_usb > now ? next_usb : now;
+        }
+        else
+        {
+            now = next_dma;
+            sim_dma_complete();
+        }
+    }
+
+    stopping = 1;
+    free_um_buffer_handle(&handle);
+    free(arena);
+    return UM_EOK;
+}
+
+static const char *ca_name(uint8_t ca)
+{
+    switch(ca)
+    {
+        case UM_BUFFER_CONFIG_CA_STRETCH:       return "stretch";
+        case UM_BUFFER_CONFIG_CA_FEEDBACK:      return "feedback";
+        case UM_BUFFER_CONFIG_CA_ASRC:          return "asrc";
+        default:                                return "none";
+    }
+}
+
+static void sim_report(void)
+{
+    uint32_t i;
+
+    printf("mode            %s\n", ca_name(cfg->ca));
+    printf("direction       %s\n", cfg->dir == UM_BUFFER_CONFIG_DIR_IN ? "in" : "out");
+    printf("seconds         %.1f\n", cfg->seconds);
+    printf("ppm             %.1f\n", cfg->ppm);
+    printf("jitter_us       %u\n", cfg->jitter_us);
+    printf("miss_prob       %g\n", cfg->miss_prob);
+    printf("geometry        %u x %u frames, %u in use\n", cfg->nodes, cfg->frames_in_node, handle.um_number_of_nodes);
+    printf("frames          %llu\n", (unsigned long long)stats.frames);
+    printf("packets         %llu\n", (unsigned long long)stats.packets);
+    printf("lost            %llu\n", (unsigned long long)stats.lost);
+    /* OUT underruns are concealed; hardware keeps running */
+    printf("underruns       %llu\n", (unsigned long long)(stats.underruns + handle.um_underruns));
+    printf("overruns        %llu\n", (unsigned long long)stats.overruns);
+    if(cfg->zero_copy)
+        printf("rx_drops        %llu\n", (unsigned long long)stats.rx_drops);
+    printf("dropout_ms      %.1f\n", stats.dropout_ns / 1e6);
+    printf("ca_activations  %llu\n", (unsigned long long)stats.ca_activations);
+    printf("hw_starts       %llu\n", (unsigned long long)stats.hw_starts);
+    if(cfg->reconfigure)
+        printf("reconfigs       %llu, max gap %.1f ms\n", (unsigned long long)stats.reconfigs, stats.reconfig_gap_max / 1e6);
+    if(cfg->dir == UM_BUFFER_CONFIG_DIR_IN)
+    {
+        printf("silent_packets  %llu\n", (unsigned long long)stats.silent_packets);
+        printf("async_packets   long %llu short %llu\n", (unsigned long long)stats.long_packets,
+            (unsigned long long)stats.short_packets);
+        if(stats.streams)
+            printf("clean_ms        avg %.1f max %llu\n", (double)stats.clean_frames_sum / stats.streams,
+                (unsigned long long)stats.clean_frames_max);
+    }
+
+    if(cfg->ca == UM_BUFFER_CONFIG_CA_ASRC)
+        printf("asrc_ppm        %.1f\n", (handle.asrc.step_delta * 1e6) / 4294967296.0);
+    if(cfg->dir == UM_BUFFER_CONFIG_DIR_OUT && cfg->ca == UM_BUFFER_CONFIG_CA_FEEDBACK)
+        printf("feedback_ppm    %.1f\n", ((double)um_fb_value(&fb) / (SIM_SAMPLES_IN_FRAME * UM_FB_ONE_SAMPLE) - 1.0) * 1e6);
+
+    if(stats.lat_samples == 0)
+    {
+        printf("latency_us      -\n\n");
+        return;
+    }
+
+    printf("latency_us      min %u avg %llu max %u\n", stats.lat_min,
+        (unsigned long long)(stats.lat_sum / stats.lat_samples), stats.lat_max);
+
+    for(i = 0; i < SIM_HIST_BINS; i++)
+    {
+        if(stats.hist[i] == 0)
+            continue;
+
+        printf("  %6u-%-6u  %12llu  %6.2f%%\n", i * SIM_HIST_BIN_US, (i + 1) * SIM_HIST_BIN_US,
+            (unsigned long long)stats.hist[i], (100.0 * stats.hist[i]) / stats.lat_samples);
+    }
+    printf("\n");
+}
+
+static void usage(const char *name)
+{
+    printf("usage: %s [options]\n"
+           "  -m, --mode none|stretch|feedback|asrc|all congestion avoidance of OUT stream (default: all)\n"
+           "  -d, --dir out|in                   stream direction (default: out)\n"
+           "  -p, --ppm PPM                      codec/ADC clock offset from USB host (default: 0)\n"
+           "  -j, --jitter US                    packet handling jitter inside frame (default: 0)\n"
+           "  -l, --loss PROB                    probability of lost isochronous packet (default: 0)\n"
+           "  -t, --time SEC                     simulated time (default: 3600)\n"
+           "  -L, --latency US                   um_handle_set_target_latency (default: half of memory)\n"
+           "  -n, --nodes N                      nodes in memory (default: 16)\n"
+           "  -f, --frames N                     USB frames in one node (default: 1)\n"
+           "  -b, --fb-interval N                frames between feedback updates (default: 8)\n"
+           "  -F, --fb-fill                      feedback from fill level sampled at SOF, no MCLK capture\n"
+           "  -a, --adc-sof-lock                 IN: ADC sampling clock is locked to SOF (stm32_adc_driver)\n"
+           "  -A, --adc-fractional               IN: ADC rate is fractional and follows capture fill level\n"
+           "  -s, --seed N                       random seed (default: 1)\n"
+           "  -i, --idle MS                      interface is idle (alt 0) for MS at the start of every second\n"
+           "  -c, --cold                         idle interface stops hardware instead of warm standby\n"
+           "  -S, --settle US                    IN: um_handle_set_settle_time (default: 0)\n"
+           "  -r, --reconfigure                  switch between N and N / 2 nodes every second (um_handle_reconfigure)\n"
+           "  -z, --zero-copy                    OUT: packets are received into the ring (stretch and feedback)\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] =
+    {
+        { "mode",        required_argument, NULL, 'm' },
+        { "dir",         required_argument, NULL, 'd' },
+        { "ppm",         required_argument, NULL, 'p' },
+        { "jitter",      required_argument, NULL, 'j' },
+        { "loss",        required_argument, NULL, 'l' },
+        { "time",        required_argument, NULL, 't' },
+        { "latency",     required_argument, NULL, 'L' },
+        { "nodes",       required_argument, NULL, 'n' },
+        { "frames",      required_argument, NULL, 'f' },
+        { "fb-interval", required_argument, NULL, 'b' },
+        { "fb-fill",     no_argument,       NULL, 'F' },
+        { "adc-sof-lock", no_argument,      NULL, 'a' },
+        { "adc-fractional", no_argument,    NULL, 'A' },
+        { "seed",        required_argument, NULL, 's' },
+        { "idle",        required_argument, NULL, 'i' },
+        { "cold",        no_argument,       NULL, 'c' },
+        { "settle",      required_argument, NULL, 'S' },
+        { "reconfigure", no_argument,       NULL, 'r' },
+        { "zero-copy",   no_argument,       NULL, 'z' },
+        { "help",        no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    static const uint8_t all_modes[] =
+    {
+        UM_BUFFER_CONFIG_CA_NONE, UM_BUFFER_CONFIG_CA_STRETCH, UM_BUFFER_CONFIG_CA_FEEDBACK, UM_BUFFER_CONFIG_CA_ASRC
+    };
+    struct sim_config config =
+    {
+        .dir = UM_BUFFER_CONFIG_DIR_OUT,
+        .seconds = 3600,
+        .nodes = 16,
+        .frames_in_node = 1,
+        .fb_interval = 8,
+        .seed = 1
+    };
+    int all = 1, opt;
+    uint32_t i;
+
+    while((opt = getopt_long(argc, argv, "m:d:p:j:l:t:L:n:f:b:FaAs:i:cS:rzh", options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'm':
+                all = strcmp(optarg, "all") == 0;
+                config.ca = strcmp(optarg, "stretch") == 0 ? UM_BUFFER_CONFIG_CA_STRETCH :
+                            strcmp(optarg, "feedback") == 0 ? UM_BUFFER_CONFIG_CA_FEEDBACK :
+                            strcmp(optarg, "asrc") == 0 ? UM_BUFFER_CONFIG_CA_ASRC :
+                            UM_BUFFER_CONFIG_CA_NONE;
+            break;
+            case 'd': config.dir = strcmp(optarg, "in") == 0 ? UM_BUFFER_CONFIG_DIR_IN : UM_BUFFER_CONFIG_DIR_OUT; break;
+            case 'p': config.ppm = atof(optarg); break;
+            case 'j': config.jitter_us = (uint32_t)atoi(optarg); break;
+            case 'l': config.miss_prob = atof(optarg); break;
+            case 't': config.seconds = atof(optarg); break;
+            case 'L': config.latency_us = (uint32_t)atoi(optarg); break;
+            case 'n': config.nodes = (uint32_t)atoi(optarg); break;
+            case 'f': config.frames_in_node = (uint32_t)atoi(optarg); break;
+            case 'b': config.fb_interval = (uint32_t)atoi(optarg); break;
+            case 'F': config.fb_fill = 1; break;
+            case 'a': config.adc_sof_lock = 1; break;
+            case 'A': config.adc_fractional = 1; break;
+            case 's': config.seed = (uint32_t)atoi(optarg); break;
+            case 'i': config.idle_ms = (uint32_t)atoi(optarg); break;
+            case 'c': config.cold_idle = 1; break;
+            case 'S': config.settle_us = (uint32_t)atoi(optarg); break;
+            case 'r': config.reconfigure = 1; break;
+            case 'z': config.zero_copy = 1; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if(config.fb_interval == 0)
+        config.fb_interval = 1;
+
+    /* capture path supports CA_NONE and asynchronous packet sizing */
+    if(config.dir == UM_BUFFER_CONFIG_DIR_IN)
+    {
+        all = 0;
+        config.ca = config.ca == UM_BUFFER_CONFIG_CA_FEEDBACK ? UM_BUFFER_CONFIG_CA_FEEDBACK : UM_BUFFER_CONFIG_CA_NONE;
+    }
+
+    for(i = 0; i < (all ? sizeof(all_modes) : 1); i++)
+    {
+        int result;
+
+        if(all)
+            config.ca = all_modes[i];
+
+        /* rx window is given for the modes, which take packet where it has been received */
+        if(config.zero_copy && config.dir == UM_BUFFER_CONFIG_DIR_OUT &&
+           config.ca != UM_BUFFER_CONFIG_CA_STRETCH && config.ca != UM_BUFFER_CONFIG_CA_FEEDBACK)
+        {
+            if(all)
+                continue;
+
+            fprintf(stderr, "%s: zero copy needs stretch or feedback\n", ca_name(config.ca));
+            return 1;
+        }
+
+        result = sim_run(&config);
+        if(result != UM_EOK)
+        {
+            fprintf(stderr, "%s: buffer configuration failed (%d)\n", ca_name(config.ca), result);
+            return 1;
+        }
+        sim_report();
+    }
+
+    return 0;
+}
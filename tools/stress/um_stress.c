@@ -0,0 +1,603 @@
+/*
+ * Two-thread stress test of the audio buffer engine (Application/usb/audio_buffer.c).
+ *
+ * USB thread passes packets through the public API as tud_task does; DMA thread emulates
+ * the double buffer DMA of codec/microphone, moves through the node under it in chunks
+ * (its position is the hardware position of the engine) and calls audio_dma_complete_cb
+ * at every node switch, as the transfer complete interrupt does. Both sides run with random
+ * delays and yields, so the two contexts interleave at random points of each other. Each side
+ * counts audio time it has passed; the one, which is ahead of the other by more than the jitter
+ * window, waits, so rates of both are the same on average whatever the scheduler does.
+ *
+ * Audio is a running count of 32 bit words, which the consumer (DMA for OUT, USB for IN)
+ * checks for continuity. Nodes, which the engine fades in after concealment or stream start,
+ * are skipped; the count itself has to continue across them. At every start and node switch
+ * both memory targets of DMA are checked against the node the engine accounts to hardware.
+ * With -P the USB thread also pauses the stream every N packets, as the host does by switching
+ * the interface to alt 0, and the stream is restarted by the following packets.
+ *
+ * Host: make -C tools/stress && ./tools/stress/um_stress -d out -m feedback -n 1000000000
+ */
+#include "audio_buffer.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STRESS_PACKET_SIZE          192 /* 48 frames of 1 ms */
+#define STRESS_SAMPLE_SIZE          4   /* 2 channels x 16 bit, one counter word */
+#define STRESS_MAX_FRAMES_IN_NODE   16
+#define STRESS_MAX_NODES            64
+/* DMA moves through the node in chunks of quarter of the packet */
+#define STRESS_CHUNK                (STRESS_PACKET_SIZE / 4)
+
+/* UM_CONCEAL_PLAYING of audio_buffer.c: DMA is in conceal node, cur_um_node_for_hw is the last played one */
+#define STRESS_CONCEAL_PLAYING      0x1
+
+#define STRESS_LOAD(x)              __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STRESS_STORE(x, v)          __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+struct stress_config
+{
+    uint8_t dir;
+    uint8_t ca;
+    uint64_t packets;
+    uint32_t frames_in_node;
+    uint32_t nodes;
+    /* longest random busy delay of each side, in loop iterations */
+    uint32_t delay;
+    /* how far in audio time one side may run ahead of the other, in packets */
+    uint32_t jitter;
+    uint32_t seed;
+    /* USB packets between pauses of the stream, 0: never paused */
+    uint64_t pause;
+};
+
+struct stress_dma
+{
+    /* written under lock by USB thread (start, resume, pause) and by DMA thread (its own pause) */
+    uint8_t running;
+    /* set by every start; stream may be stopped and started again between two chunks of DMA thread */
+    uint8_t started;
+    uint8_t ct;
+    uint32_t target[2];
+    uint32_t size;
+    uint32_t progress;
+    /* hardware position read by the engine from USB thread */
+    uint32_t position;
+};
+
+struct stress_stats
+{
+    uint64_t packets;
+    uint64_t retries;
+    /* DMA has been ahead of real time: queued node is not finished by USB yet */
+    uint64_t waits;
+    uint64_t silent_packets;
+    uint64_t nodes;
+    uint64_t conceal_nodes;
+    uint64_t faded_nodes;
+    uint64_t words;
+    uint64_t target_checks;
+    uint64_t starts;
+    uint64_t overruns;
+    uint64_t pauses;
+};
+
+static struct stress_config cfg =
+{
+    .dir = UM_BUFFER_CONFIG_DIR_OUT,
+    .ca = UM_BUFFER_CONFIG_CA_FEEDBACK,
+    .packets = 100000000ULL,
+    .frames_in_node = 4,
+    .nodes = 4,
+    .delay = 200,
+    .jitter = 4,
+    .seed = 1,
+    .pause = 0
+};
+
+static struct um_buffer_handle handle;
+static uint8_t arena[UM_BUFFER_MEM_SIZE(STRESS_PACKET_SIZE + STRESS_SAMPLE_SIZE, STRESS_MAX_FRAMES_IN_NODE, STRESS_MAX_NODES)]
+    __attribute__((aligned(4)));
+
+static struct stress_dma dma;
+static struct stress_stats stats;
+/* DMA thread holds it while it moves and while it is in the interrupt; stop and start of hardware take it */
+static pthread_mutex_t dma_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread uint8_t in_interrupt;
+static uint8_t done;
+/* audio time of each side in bytes of the stream; it goes on, whether the side has passed audio or not */
+static uint64_t usb_time;
+static uint64_t dma_time;
+
+static uint32_t stress_rand(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/* Busy delay of random length up to max; now and then the thread gives the CPU away in the middle of its work */
+static void stress_delay(uint32_t *state, uint32_t max)
+{
+    uint32_t r = stress_rand(state);
+    uint32_t i;
+
+    for(i = r % (max + 1); i != 0; i--)
+        __asm volatile("" ::: "memory");
+
+    if((r >> 24) < 8)
+        sched_yield();
+}
+
+static void stress_pace(uint64_t *mine, uint64_t *other, uint32_t bytes)
+{
+    uint64_t window = (uint64_t)cfg.jitter * STRESS_PACKET_SIZE;
+
+    while(STRESS_LOAD(*mine) > STRESS_LOAD(*other) + window && !STRESS_LOAD(done))
+        sched_yield();
+
+    STRESS_STORE(*mine, *mine + bytes);
+}
+
+static uint32_t *stress_ptr(uint32_t addr)
+{
+    return (uint32_t *)(arena + (addr - UM_ADDR(arena)));
+}
+
+static uint32_t stress_node_addr(uint32_t node)
+{
+    return UM_ADDR(UM_NODE(&handle, node)->um_buf);
+}
+
+static void stress_fail(const char *what, uint32_t got, uint32_t expected)
+{
+    fprintf(stderr, "FAIL: %s: got %u, expected %u (packet %llu, usb node %u, hw node %u, conceal state 0x%x)\n",
+        what, (unsigned)got, (unsigned)expected, (unsigned long long)stats.packets,
+        (unsigned)handle.cur_um_node_for_usb, (unsigned)handle.cur_um_node_for_hw, (unsigned)handle.um_conceal_state);
+    exit(1);
+}
+
+/*=====================================================================*/
+/*=================== HARDWARE CALLBACKS OF ENGINE ====================*/
+/*=====================================================================*/
+
+/* Memory targets are given as offsets in memory block */
+static void stress_check_target(const char *what, uint32_t target, uint32_t expected)
+{
+    if(target != expected)
+        stress_fail(what, target - UM_ADDR(arena), expected - UM_ADDR(arena));
+}
+
+/* DMA starts on the node, which engine accounts to hardware, and continues with the next one in memory */
+static void stress_play(uint32_t addr, uint32_t size)
+{
+    stress_check_target("first node of DMA", addr, stress_node_addr(handle.cur_um_node_for_hw));
+    stress_check_target("second node of DMA", addr + size, stress_node_addr(handle.cur_um_node_for_hw + 1));
+
+    pthread_mutex_lock(&dma_lock);
+    dma.target[0] = addr;
+    dma.target[1] = addr + size;
+    dma.ct = 0;
+    dma.size = size;
+    dma.progress = 0;
+    STRESS_STORE(dma.position, addr);
+    dma.running = 1;
+    dma.started = 1;
+    stats.starts++;
+    pthread_mutex_unlock(&dma_lock);
+}
+
+/* Stop is synchronous: DMA thread is out of its transfer and interrupt, when pause returns */
+static uint32_t stress_pause_resume(uint32_t cmd, uint32_t addr, uint32_t size)
+{
+    (void)addr;
+    (void)size;
+
+    if(in_interrupt)
+    {
+        dma.running = (uint8_t)cmd;
+        stats.overruns += cmd == 0;
+        return 0;
+    }
+
+    pthread_mutex_lock(&dma_lock);
+    dma.running = (uint8_t)cmd;
+    dma.started |= (uint8_t)cmd;
+    stats.starts += cmd != 0;
+    pthread_mutex_unlock(&dma_lock);
+    return 0;
+}
+
+static void stress_next_node(uint32_t addr)
+{
+    dma.target[dma.ct ^ 1] = addr;
+}
+
+static uint32_t stress_position(void)
+{
+    return STRESS_LOAD(dma.position);
+}
+
+/*=====================================================================*/
+/*============================ DMA THREAD =============================*/
+/*=====================================================================*/
+
+/* OUT consumer: checks what it plays; a node after conceal node is faded in and only counted */
+static void dma_play_chunk(uint32_t *expected, uint8_t *resync, uint8_t *faded)
+{
+    uint32_t addr = dma.target[dma.ct];
+    uint32_t *words = stress_ptr(addr + dma.progress);
+    uint32_t i;
+
+    if(addr == UM_ADDR(handle.um_conceal_node))
+    {
+        if(dma.progress == 0)
+        {
+            stats.conceal_nodes++;
+            *faded = 1;
+        }
+        return;
+    }
+
+    if(*faded)
+    {
+        if(dma.progress == 0)
+            stats.faded_nodes++;
+        if(!*resync)
+            *expected += STRESS_CHUNK / 4;
+        return;
+    }
+
+    for(i = 0; i < STRESS_CHUNK / 4; i++)
+    {
+        if(*resync)
+        {
+            *expected = words[i];
+            *resync = 0;
+        }
+
+        if(words[i] != *expected)
+            stress_fail("played word", words[i], *expected);
+
+        (*expected)++;
+    }
+    stats.words += STRESS_CHUNK / 4;
+}
+
+/* After node switch DMA is in the node under hardware (or in conceal node, while engine plays it),
+ * and the other target is the node after it (or conceal node, OUT only) */
+static void dma_check_targets(void)
+{
+    uint32_t conceal = UM_ADDR(handle.um_conceal_node);
+    uint32_t hw = handle.cur_um_node_for_hw;
+    uint32_t queued = dma.target[dma.ct ^ 1];
+
+    stress_check_target("node under DMA", dma.target[dma.ct],
+        (handle.um_conceal_state & STRESS_CONCEAL_PLAYING) ? conceal : stress_node_addr(hw));
+
+    if(cfg.dir == UM_BUFFER_CONFIG_DIR_IN || queued != conceal)
+        stress_check_target("queued node", queued, stress_node_addr(hw + 1));
+
+    stats.target_checks++;
+}
+
+/* IN producer: captures the count into the node under it */
+static void dma_capture_chunk(uint32_t *count)
+{
+    uint32_t *words = stress_ptr(dma.target[dma.ct] + dma.progress);
+    uint32_t i;
+
+    for(i = 0; i < STRESS_CHUNK / 4; i++)
+        words[i] = (*count)++;
+}
+
+static void *dma_thread(void *arg)
+{
+    uint32_t rnd = cfg.seed * 7919 + 1;
+    uint32_t count = 0;
+    uint8_t resync = 1, faded = 0;
+
+    (void)arg;
+
+    while(!STRESS_LOAD(done))
+    {
+        stress_pace(&dma_time, &usb_time, STRESS_CHUNK);
+        pthread_mutex_lock(&dma_lock);
+
+        /* data after restart does not continue the stream */
+        if(!dma.running || dma.started)
+        {
+            resync = 1;
+            faded = 0;
+            dma.started = 0;
+        }
+
+        if(!dma.running)
+        {
+            pthread_mutex_unlock(&dma_lock);
+            sched_yield();
+            continue;
+        }
+
+        /* real time: USB side finishes the node, which has been queued to DMA, while DMA plays the one before it */
+        if(cfg.dir == UM_BUFFER_CONFIG_DIR_OUT && dma.progress == 0 && dma.target[dma.ct] != UM_ADDR(handle.um_conceal_node) &&
+           (int32_t)(STRESS_LOAD(handle.cur_um_node_for_usb) - handle.cur_um_node_for_hw) <= 0)
+        {
+            stats.waits++;
+            pthread_mutex_unlock(&dma_lock);
+            sched_yield();
+            continue;
+        }
+
+        if(cfg.dir == UM_BUFFER_CONFIG_DIR_IN)
+            dma_capture_chunk(&count);
+        else
+            dma_play_chunk(&count, &resync, &faded);
+
+        dma.progress += STRESS_CHUNK;
+
+        if(dma.progress == dma.size)
+        {
+            if(dma.target[dma.ct] != UM_ADDR(handle.um_conceal_node))
+            {
+                stats.nodes++;
+                faded = 0;
+            }
+
+            /* hardware switches to the other memory target and raises transfer complete */
+            dma.ct ^= 1;
+            dma.progress = 0;
+            STRESS_STORE(dma.position, dma.target[dma.ct]);
+
+            in_interrupt = 1;
+            audio_dma_complete_cb(&handle);
+            in_interrupt = 0;
+
+            /* engine may have stopped hardware on overrun */
+            if(dma.running)
+                dma_check_targets();
+        }
+        else
+        {
+            STRESS_STORE(dma.position, dma.target[dma.ct] + dma.progress);
+        }
+
+        pthread_mutex_unlock(&dma_lock);
+        /* DMA takes as long for a packet as USB side does on average */
+        stress_delay(&rnd, (cfg.delay * STRESS_CHUNK) / STRESS_PACKET_SIZE);
+    }
+
+    return NULL;
+}
+
+/*=====================================================================*/
+/*============================ USB THREAD =============================*/
+/*=====================================================================*/
+
+/* Host switches interface to alt 0 and back; the next packets start hardware again */
+static void usb_pause(void)
+{
+    if(cfg.pause == 0 || (stats.packets % cfg.pause) != 0)
+        return;
+
+    um_handle_pause(&handle);
+    stats.pauses++;
+}
+
+static void usb_out(void)
+{
+    uint32_t rnd = cfg.seed;
+    uint32_t count = 0;
+    struct um_span span[2];
+
+    while(stats.packets < cfg.packets)
+    {
+        uint32_t size = STRESS_PACKET_SIZE;
+        uint32_t spans, s, i;
+
+        stress_pace(&usb_time, &dma_time, STRESS_PACKET_SIZE);
+
+        /* host follows feedback with packets one frame longer or shorter */
+        if(cfg.ca == UM_BUFFER_CONFIG_CA_FEEDBACK)
+            size += STRESS_SAMPLE_SIZE * ((stress_rand(&rnd) % 3) - 1);
+
+        spans = um_handle_reserve(&handle, size, span);
+        if(spans == 0)
+        {
+            stats.retries++;
+            sched_yield();
+            continue;
+        }
+
+        for(s = 0, i = 0; s < spans; s++)
+        {
+            uint32_t *words = (uint32_t *)span[s].ptr;
+            uint32_t w;
+
+            for(w = 0; w < span[s].size / 4; w++, i++)
+                words[w] = count + i;
+        }
+
+        /* packet is not taken, if DMA has not freed the room yet; the same count is sent again */
+        if(um_handle_commit(&handle, size) != UM_EOK)
+        {
+            stats.retries++;
+            sched_yield();
+            continue;
+        }
+
+        count += size / 4;
+        stats.packets++;
+        usb_pause();
+        stress_delay(&rnd, cfg.delay);
+    }
+}
+
+static void usb_in(void)
+{
+    uint32_t rnd = cfg.seed;
+    uint32_t expected = 0, skip = 0;
+    uint8_t resync = 1;
+    struct um_span span[2];
+
+    while(stats.packets < cfg.packets)
+    {
+        uint32_t spans, s, w;
+
+        stress_pace(&usb_time, &dma_time, STRESS_PACKET_SIZE);
+
+        spans = um_handle_read(&handle, span);
+        if(spans == 0)
+        {
+            stats.retries++;
+            sched_yield();
+            continue;
+        }
+
+        stats.packets++;
+
+        /* hardware start or preroll: stream goes on from the node, which is faded in after it */
+        if(span[0].ptr == handle.um_conceal_node)
+        {
+            stats.silent_packets++;
+            skip = handle.um_node_size;
+            resync = 1;
+            usb_pause();
+            stress_delay(&rnd, cfg.delay);
+            continue;
+        }
+
+        for(s = 0; s < spans; s++)
+        {
+            const uint32_t *words = (const uint32_t *)span[s].ptr;
+
+            for(w = 0; w < span[s].size / 4; w++)
+            {
+                if(skip != 0)
+                {
+                    skip -= 4;
+                    continue;
+                }
+
+                if(resync)
+                {
+                    expected = words[w];
+                    resync = 0;
+                }
+
+                if(words[w] != expected)
+                    stress_fail("captured word", words[w], expected);
+
+                expected++;
+                stats.words++;
+            }
+        }
+
+        usb_pause();
+        stress_delay(&rnd, cfg.delay);
+    }
+}
+
+static const char *ca_name(uint8_t ca)
+{
+    return ca == UM_BUFFER_CONFIG_CA_FEEDBACK ? "feedback" : "none";
+}
+
+static void usage(const char *name)
+{
+    printf("usage: %s [options]\n"
+           "  -d, --dir out|in           stream direction (default: out)\n"
+           "  -m, --mode none|feedback   congestion avoidance, which keeps audio as it is (default: feedback)\n"
+           "  -n, --packets N            USB packets to pass (default: 100000000)\n"
+           "  -f, --frames N             USB frames in one node, up to %u (default: 4)\n"
+           "  -N, --nodes N              nodes, power of two up to %u (default: 4)\n"
+           "  -D, --delay N              longest random delay of each side, loop iterations (default: 200)\n"
+           "  -j, --jitter N             packets one side may run ahead of the other (default: 4)\n"
+           "  -s, --seed N               random seed (default: 1)\n"
+           "  -P, --pause N              pause the stream every N packets (default: 0, never)\n",
+           name, (unsigned)STRESS_MAX_FRAMES_IN_NODE, (unsigned)STRESS_MAX_NODES);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] =
+    {
+        { "dir",     required_argument, NULL, 'd' },
+        { "mode",    required_argument, NULL, 'm' },
+        { "packets", required_argument, NULL, 'n' },
+        { "frames",  required_argument, NULL, 'f' },
+        { "nodes",   required_argument, NULL, 'N' },
+        { "delay",   required_argument, NULL, 'D' },
+        { "jitter",  required_argument, NULL, 'j' },
+        { "seed",    required_argument, NULL, 's' },
+        { "pause",   required_argument, NULL, 'P' },
+        { "help",    no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    pthread_t thread;
+    int opt, result;
+
+    while((opt = getopt_long(argc, argv, "d:m:n:f:N:D:j:s:P:h", options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'd': cfg.dir = strcmp(optarg, "in") == 0 ? UM_BUFFER_CONFIG_DIR_IN : UM_BUFFER_CONFIG_DIR_OUT; break;
+            case 'm': cfg.ca = strcmp(optarg, "none") == 0 ? UM_BUFFER_CONFIG_CA_NONE : UM_BUFFER_CONFIG_CA_FEEDBACK; break;
+            case 'n': cfg.packets = strtoull(optarg, NULL, 0); break;
+            case 'f': cfg.frames_in_node = (uint32_t)atoi(optarg); break;
+            case 'N': cfg.nodes = (uint32_t)atoi(optarg); break;
+            case 'D': cfg.delay = (uint32_t)atoi(optarg); break;
+            case 'j': cfg.jitter = (uint32_t)atoi(optarg); break;
+            case 's': cfg.seed = (uint32_t)atoi(optarg); break;
+            case 'P': cfg.pause = strtoull(optarg, NULL, 0); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if(cfg.frames_in_node == 0 || cfg.frames_in_node > STRESS_MAX_FRAMES_IN_NODE || cfg.nodes > STRESS_MAX_NODES || cfg.seed == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    result = um_handle_init(&handle, arena, sizeof(arena), STRESS_PACKET_SIZE, STRESS_SAMPLE_SIZE,
+        cfg.frames_in_node, cfg.nodes, cfg.ca | cfg.dir, stress_play, stress_pause_resume, stress_next_node);
+    if(result != UM_EOK)
+    {
+        fprintf(stderr, "buffer configuration failed (%d)\n", result);
+        return 1;
+    }
+    um_handle_set_hw_position(&handle, stress_position);
+
+    pthread_create(&thread, NULL, dma_thread, NULL);
+
+    if(cfg.dir == UM_BUFFER_CONFIG_DIR_IN)
+        usb_in();
+    else
+        usb_out();
+
+    STRESS_STORE(done, 1);
+    pthread_join(thread, NULL);
+
+    printf("dir %s mode %s frames %u nodes %u\n", cfg.dir == UM_BUFFER_CONFIG_DIR_IN ? "in" : "out",
+        ca_name(cfg.ca), (unsigned)cfg.frames_in_node, (unsigned)cfg.nodes);
+    printf("packets         %llu (retried %llu, silent %llu)\n", (unsigned long long)stats.packets,
+        (unsigned long long)stats.retries, (unsigned long long)stats.silent_packets);
+    printf("nodes           %llu (conceal %llu, faded in %llu, waited %llu)\n", (unsigned long long)stats.nodes,
+        (unsigned long long)stats.conceal_nodes, (unsigned long long)stats.faded_nodes, (unsigned long long)stats.waits);
+    printf("words checked   %llu, DMA targets checked %llu\n", (unsigned long long)stats.words,
+        (unsigned long long)stats.target_checks);
+    printf("hw starts       %llu, overruns %llu, underruns %u, pauses %llu\n", (unsigned long long)stats.starts,
+        (unsigned long long)stats.overruns, (unsigned)handle.um_underruns, (unsigned long long)stats.pauses);
+
+    return 0;
+}